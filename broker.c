@@ -2,33 +2,283 @@
 #include <linux/slab.h>
 #include <linux/kernel.h>
 #include <linux/string.h>
+#include <linux/stringhash.h>
+#include <linux/rculist.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/idr.h>
+#include <linux/percpu_counter.h>
+#include <linux/shrinker.h>
+#include <linux/workqueue.h>
+#include <linux/completion.h>
+#include <linux/cpumask.h>
+#include <linux/fs.h>
 #include "broker.h"
+#include "pubsub_trace.h"
 
+/*
+ * Modelo de concorrencia:
+ *  - my_broker.lock (mutex) serializa criacao de topicos e as listas
+ *    publish/subscriber do broker. A busca por nome e feita sob RCU e
+ *    nao pega esse lock; topicos so sao liberados em broker_exit().
+ *  - topic->sub_lock (rwsem) protege as listas de processos do topico.
+ *    Publicadores pegam em modo leitura, entao publicacoes no mesmo
+ *    topico nao se serializam; inscricoes/remocoes pegam em escrita.
+ *  - process->mailbox_lock (spinlock) protege o anel de cada inscrito.
+ *  - A trie de filtros ('+'/'#') cresce sob my_broker.lock e e lida sem
+ *    lock na publicacao; seus nos tambem so saem em broker_exit().
+ *  - topic->block_busy serializa os publicadores BLOCK de cada topico; e
+ *    pego sem esperar com nada acima seguro (ver targets_claim()).
+ * Ordem: my_broker.lock -> topic->sub_lock -> process->mailbox_lock.
+ */
 static broker_s my_broker;
 
-void broker_init(void)
+/* Bit de topic->block_busy: um publicador BLOCK esta entregando no topico */
+#define TOPIC_BLOCK_BUSY 0
+
+/*
+ * Classes de tamanho dos payloads. O cabecalho payload_s e os dados ficam
+ * no mesmo objeto, entao mensagens curtas custam uma unica alocacao.
+ * Payloads maiores que a ultima classe usam kvmalloc: ate algumas paginas
+ * vem do kmalloc, acima disso de paginas avulsas mapeadas com vmalloc, sem
+ * exigir memoria fisicamente contigua.
+ */
+static const size_t payload_class_size[] = { 64, 256, 1024 };
+static const char *const payload_class_name[] = {
+    "pubsub_payload_64", "pubsub_payload_256", "pubsub_payload_1024"
+};
+static struct kmem_cache *payload_cache[ARRAY_SIZE(payload_class_size)];
+static struct kmem_cache *topic_cache;
+static struct kmem_cache *process_cache;
+
+/*
+ * Memoria das mensagens. payload_bytes soma todos os payloads vivos (cada
+ * um conta uma vez, por mais mailboxes que o referenciem) mais os aneis
+ * mmap e e comparado com max_queued_bytes; queued_msgs conta entradas nas
+ * mailboxes e ring_bytes a parte dos aneis mmap, que o shrinker nao
+ * alcanca. percpu_counter para nao criar uma linha de cache global disputada por
+ * todos os publicadores; o lote dos contadores de bytes e em bytes,
+ * porque com o padrao (32) toda cobranca, de pelo menos um cabecalho,
+ * cairia no lock global do contador.
+ */
+#define PAYLOAD_BYTES_BATCH (1 << 20)
+
+static struct percpu_counter payload_bytes;
+static struct percpu_counter queued_msgs;
+static struct percpu_counter ring_bytes;
+static struct shrinker broker_shrinker;
+static bool shrinker_registered;
+
+/*
+ * Cobra 'bytes' de payload_bytes; -ENOMEM se passaria de max_queued_bytes.
+ * A comparacao usa o mesmo lote da soma, entao so quando o total esta a
+ * menos de PAYLOAD_BYTES_BATCH por CPU do limite ela soma as CPUs.
+ */
+static int memory_charge(s64 bytes)
 {
-    INIT_LIST_HEAD(&my_broker.subscriber);
-    INIT_LIST_HEAD(&my_broker.publish);
-    printk(KERN_INFO "[BROKER_INIT] Broker initialized.\n");
+    unsigned long budget = READ_ONCE(max_queued_bytes);
+
+    percpu_counter_add_batch(&payload_bytes, bytes, PAYLOAD_BYTES_BATCH);
+    if (budget && __percpu_counter_compare(&payload_bytes, budget, PAYLOAD_BYTES_BATCH) > 0) {
+        percpu_counter_add_batch(&payload_bytes, -bytes, PAYLOAD_BYTES_BATCH);
+        return -ENOMEM;
+    }
+    return 0;
 }
 
-void insert_topic_to_broker(topic_s *topic, char list_type)
+static void memory_uncharge(s64 bytes)
 {
-    if (!topic) {
-        return;
+    percpu_counter_add_batch(&payload_bytes, -bytes, PAYLOAD_BYTES_BATCH);
+}
+
+/* Bytes que o payload ocupa em payload_bytes, cabecalho incluido */
+static s64 payload_charge(payload_s *payload)
+{
+    return sizeof(*payload) + payload->size;
+}
+
+/* Anel mmap: conta no orcamento e tambem em ring_bytes */
+static int ring_charge(s64 bytes)
+{
+    int ret = memory_charge(bytes);
+
+    if (!ret) {
+        percpu_counter_add(&ring_bytes, bytes);
     }
-    if (list_type == 's') {
-        list_add_tail(&topic->subscribe_node, &my_broker.subscriber);
-        printk(KERN_INFO "[INSERT_TOPIC] Topic '%s' added to subscriber list.\n", topic->name);
-    } else if (list_type == 'p') {
-        list_add_tail(&topic->publish_node, &my_broker.publish);
-        printk(KERN_INFO "[INSERT_TOPIC] Topic '%s' added to publish list.\n", topic->name);
+    return ret;
+}
+
+static void ring_uncharge(s64 bytes)
+{
+    percpu_counter_add(&ring_bytes, -bytes);
+    memory_uncharge(bytes);
+}
+
+/*
+ * Fan-out assincrono. fanout_wq roda a fila de cada topico (um work por
+ * topico, entao a ordem e mantida); shard_wq recebe as fatias de listas
+ * grandes. Filas separadas: quem espera as fatias nunca ocupa o lugar
+ * delas.
+ */
+static struct workqueue_struct *fanout_wq;
+static struct workqueue_struct *shard_wq;
+
+/* Inscritos por fatia; abaixo disso o custo de acordar outra CPU nao paga */
+#define FANOUT_SHARD_MIN 512
+#define FANOUT_MAX_SHARDS 16
+
+typedef struct {
+    struct list_head node;
+    unsigned long seq;              /* topic->async_queued quando entrou na fila */
+    unsigned int count;
+    payload_s *payloads[];
+} async_batch_s;
+
+static void topic_async_work(struct work_struct *work);
+static int mailbox_push(process_s *process, payload_s *payload, int policy);
+
+static unsigned long broker_shrink_count(struct shrinker *shrink, struct shrink_control *sc);
+static unsigned long broker_shrink_scan(struct shrinker *shrink, struct shrink_control *sc);
+
+static unsigned int topic_hash(const char *name)
+{
+    return full_name_hash(NULL, name, strlen(name));
+}
+
+static topic_table_s *topic_table_alloc(unsigned int bits, unsigned int slot)
+{
+    topic_table_s *table;
+    unsigned int i;
+
+    table = kvmalloc(sizeof(*table) + (sizeof(table->buckets[0]) << bits), GFP_KERNEL);
+    if (!table) {
+        return NULL;
+    }
+    table->bits = bits;
+    table->slot = slot;
+    for (i = 0; i < (1U << bits); i++) {
+        INIT_HLIST_HEAD(&table->buckets[i]);
+    }
+    return table;
+}
+
+static struct hlist_head *topic_bucket(topic_table_s *table, unsigned int hash)
+{
+    return &table->buckets[hash_32(hash, table->bits)];
+}
+
+static void broker_destroy_caches(void)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(payload_cache); i++) {
+        kmem_cache_destroy(payload_cache[i]);
+        payload_cache[i] = NULL;
+    }
+    kmem_cache_destroy(process_cache);
+    kmem_cache_destroy(topic_cache);
+    process_cache = NULL;
+    topic_cache = NULL;
+}
+
+static void broker_destroy_workqueues(void)
+{
+    /* destroy_workqueue() termina o que ainda estiver na fila */
+    if (fanout_wq) {
+        destroy_workqueue(fanout_wq);
+        fanout_wq = NULL;
+    }
+    if (shard_wq) {
+        destroy_workqueue(shard_wq);
+        shard_wq = NULL;
+    }
+}
+
+/*
+ * As inscricoes e os payloads sao cobrados do memcg de quem os aloca
+ * (SLAB_ACCOUNT / __GFP_ACCOUNT): a mailbox do inscrito e o payload do
+ * publicador, ja que um payload e compartilhado por todas as mailboxes.
+ */
+int broker_init(void)
+{
+    int i;
+
+    topic_cache = kmem_cache_create("pubsub_topic", sizeof(topic_s), 0, SLAB_HWCACHE_ALIGN, NULL);
+    process_cache = kmem_cache_create("pubsub_process", sizeof(process_s), 0, SLAB_HWCACHE_ALIGN | SLAB_ACCOUNT, NULL);
+    if (!topic_cache || !process_cache) {
+        goto fail;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(payload_cache); i++) {
+        payload_cache[i] = kmem_cache_create(payload_class_name[i], payload_class_size[i], 0, SLAB_ACCOUNT, NULL);
+        if (!payload_cache[i]) {
+            goto fail;
+        }
+    }
+
+    if (percpu_counter_init(&payload_bytes, 0, GFP_KERNEL)) {
+        goto fail;
+    }
+    if (percpu_counter_init(&queued_msgs, 0, GFP_KERNEL)) {
+        percpu_counter_destroy(&payload_bytes);
+        goto fail;
+    }
+    if (percpu_counter_init(&ring_bytes, 0, GFP_KERNEL)) {
+        percpu_counter_destroy(&queued_msgs);
+        percpu_counter_destroy(&payload_bytes);
+        goto fail;
+    }
+
+    fanout_wq = alloc_workqueue("pubsub_fanout", WQ_UNBOUND, 0);
+    shard_wq = alloc_workqueue("pubsub_shard", WQ_UNBOUND, 0);
+    if (!fanout_wq || !shard_wq) {
+        broker_destroy_workqueues();
+        percpu_counter_destroy(&ring_bytes);
+        percpu_counter_destroy(&queued_msgs);
+        percpu_counter_destroy(&payload_bytes);
+        goto fail;
+    }
+
+    my_broker.topic_table = topic_table_alloc(clamp_t(int, topic_hash_bits, 4, BROKER_HASH_MAX_BITS), 0);
+    if (!my_broker.topic_table) {
+        broker_destroy_workqueues();
+        percpu_counter_destroy(&ring_bytes);
+        percpu_counter_destroy(&queued_msgs);
+        percpu_counter_destroy(&payload_bytes);
+        goto fail;
+    }
+    my_broker.nr_topics = 0;
+
+    idr_init(&my_broker.topic_ids);
+    INIT_LIST_HEAD(&my_broker.filters.children);
+    mutex_init(&my_broker.lock);
+    INIT_LIST_HEAD(&my_broker.subscriber);
+    INIT_LIST_HEAD(&my_broker.publish);
+
+    broker_shrinker.count_objects = broker_shrink_count;
+    broker_shrinker.scan_objects = broker_shrink_scan;
+    broker_shrinker.seeks = DEFAULT_SEEKS;
+    if (register_shrinker(&broker_shrinker)) {
+        /* Sem shrinker o broker funciona, so nao devolve memoria sob pressao */
+        printk(KERN_WARNING "[BROKER_INIT] Failed to register shrinker.\n");
     } else {
-        printk(KERN_WARNING "[INSERT_TOPIC] Invalid list type '%c'.\n", list_type);
+        shrinker_registered = true;
     }
+
+    printk(KERN_INFO "[BROKER_INIT] Broker initialized.\n");
+    return 0;
+
+fail:
+    printk(KERN_ERR "[BROKER_INIT] Failed to create caches, workqueues or the topic table.\n");
+    broker_destroy_caches();
+    return -ENOMEM;
 }
 
+/* Chamadas com topic->sub_lock */
 int is_pid_in_subscribers(int pid, topic_s *topic)
 {
     process_s *proc_entry;
@@ -51,54 +301,147 @@ int is_pid_in_publishers(int pid, topic_s *topic)
     return 0;
 }
 
-topic_s *find_topic(const char *name)
+/*
+ * Dobra a tabela quando passa de um topico por bucket. Chamada com
+ * my_broker.lock. Os topicos entram na nova pelo outro hash_node, entao
+ * quem ainda percorre a antiga segue valido; depois do synchronize_rcu()
+ * ninguem mais a usa e seus nos podem ser reaproveitados no proximo
+ * crescimento. Sem memoria a tabela fica como esta, so mais lenta.
+ */
+static void topic_table_grow(topic_table_s *old)
 {
-    topic_s *entry;
+    topic_table_s *table;
+    topic_s *topic;
+    int id;
+
+    if (my_broker.nr_topics <= (1U << old->bits) || old->bits >= BROKER_HASH_MAX_BITS) {
+        return;
+    }
+    table = topic_table_alloc(old->bits + 1, !old->slot);
+    if (!table) {
+        return;
+    }
+
+    /* Todo topico com handle ja esta na tabela atual */
+    idr_for_each_entry(&my_broker.topic_ids, topic, id) {
+        hlist_add_head_rcu(&topic->hash_node[table->slot], topic_bucket(table, topic->hash));
+    }
+    rcu_assign_pointer(my_broker.topic_table, table);
+    synchronize_rcu();
+    kvfree(old);
+}
+
+static int topic_matches(topic_s *topic, const char *name, unsigned int hash)
+{
+    return topic->hash == hash && strcmp(topic->name, name) == 0;
+}
 
-    printk(KERN_INFO "[FIND_TOPIC] Searching for topic: %s.\n", name);
+topic_s *find_topic(const char *name)
+{
+    topic_table_s *table;
+    topic_s *entry, *found = NULL;
+    unsigned int hash = topic_hash(name);
 
-    list_for_each_entry(entry, &my_broker.publish, publish_node) {
-        if (strcmp(entry->name, name) == 0) {
-            printk(KERN_INFO "[FIND_TOPIC] Found topic '%s' in publish list.\n", name);
-            return entry;
+    rcu_read_lock();
+    table = rcu_dereference(my_broker.topic_table);
+    /* O membro de hlist_for_each_entry_rcu tem de ser fixo */
+    if (table->slot == 0) {
+        hlist_for_each_entry_rcu(entry, topic_bucket(table, hash), hash_node[0]) {
+            if (topic_matches(entry, name, hash)) {
+                found = entry;
+                break;
+            }
+        }
+    } else {
+        hlist_for_each_entry_rcu(entry, topic_bucket(table, hash), hash_node[1]) {
+            if (topic_matches(entry, name, hash)) {
+                found = entry;
+                break;
+            }
         }
     }
+    rcu_read_unlock();
+
+    return found;
+}
 
-    list_for_each_entry(entry, &my_broker.subscriber, subscribe_node) {
-        if (strcmp(entry->name, name) == 0) {
-            printk(KERN_INFO "[FIND_TOPIC] Found topic '%s' in subscriber list.\n", name);
-            return entry;
+static void log_free(payload_s **log, unsigned int size)
+{
+    unsigned int i;
+
+    if (!log) {
+        return;
+    }
+    for (i = 0; i < size; i++) {
+        if (log[i]) {
+            payload_put(log[i]);
         }
     }
-    
-    printk(KERN_INFO "[FIND_TOPIC] Topic '%s' not found.\n", name);
-    return NULL;
+    kvfree(log);
+}
+
+static void topic_free(topic_s *topic)
+{
+    log_free(topic->log, topic->log_size);
+    if (topic->retained) {
+        payload_put(topic->retained);
+    }
+    free_percpu(topic->stats);
+    kfree(topic->name);
+    kmem_cache_free(topic_cache, topic);
 }
 
 topic_s *create_topic(const char *name)
 {
     topic_s *topic;
 
-    printk(KERN_INFO "[CREATE_TOPIC] Creating topic: %s.\n", name);
-
-    topic = kmalloc(sizeof(*topic), GFP_KERNEL);
+    topic = kmem_cache_alloc(topic_cache, GFP_KERNEL);
     if (!topic) {
         printk(KERN_ERR "[CREATE_TOPIC] Failed to allocate memory for topic '%s'.\n", name);
         return NULL;
     }
 
+    /* topic_free() libera o log e a retida: tem de valer antes da primeira falha */
+    spin_lock_init(&topic->log_lock);
+    topic->log = NULL;
+    topic->log_size = 0;
+    topic->log_head = 0;
+    topic->retain = 0;
+    topic->retained = NULL;
+
     topic->name = kstrdup(name, GFP_KERNEL);
-    if (!topic->name) {
-        printk(KERN_ERR "[CREATE_TOPIC] Failed to allocate memory for topic name.\n");
-        kfree(topic);
+    topic->stats = alloc_percpu(topic_stats_s);
+    if (!topic->name || !topic->stats) {
+        printk(KERN_ERR "[CREATE_TOPIC] Failed to allocate memory for topic '%s'.\n", name);
+        topic_free(topic);
         return NULL;
     }
 
+    topic->hash = topic_hash(topic->name);
+    topic->id = 0;
+    topic->is_filter = 0;
     topic->msg_count = 0;
+    INIT_HLIST_NODE(&topic->hash_node[0]);
+    INIT_HLIST_NODE(&topic->hash_node[1]);
     INIT_LIST_HEAD(&topic->publish_node);
     INIT_LIST_HEAD(&topic->subscribe_node);
     INIT_LIST_HEAD(&topic->process_subscribers);
     INIT_LIST_HEAD(&topic->process_publishers);
+    init_rwsem(&topic->sub_lock);
+    init_waitqueue_head(&topic->poll_wait);
+    topic->policy = PUBSUB_POLICY_OVERWRITE;
+    topic->block_timeout_ms = DEFAULT_BLOCK_TIMEOUT_MS;
+    topic->block_busy = 0;
+    init_waitqueue_head(&topic->space_wait);
+    atomic_set(&topic->space_seq, 0);
+    topic->nr_subscribers = 0;
+    topic->async = 0;
+    spin_lock_init(&topic->async_lock);
+    INIT_LIST_HEAD(&topic->async_queue);
+    INIT_WORK(&topic->async_work, topic_async_work);
+    topic->async_queued = 0;
+    topic->async_done = 0;
+    init_waitqueue_head(&topic->async_wait);
 
     printk(KERN_INFO "[CREATE_TOPIC] Topic '%s' created.\n", topic->name);
     return topic;
@@ -108,256 +451,2152 @@ process_s *create_process(int pid)
 {
     process_s *process;
 
-    printk(KERN_INFO "[CREATE_PROCESS] Creating process for PID: %d.\n", pid);
-
-    process = kmalloc(sizeof(*process), GFP_KERNEL);
+    process = kmem_cache_alloc(process_cache, GFP_KERNEL);
     if (!process) {
         printk(KERN_ERR "[CREATE_PROCESS] Failed to allocate memory for new process.\n");
         return NULL;
     }
 
+    kref_init(&process->ref);
+    spin_lock_init(&process->mailbox_lock);
+    init_waitqueue_head(&process->wait);
+    process->removed = 0;
     process->pid = pid;
+    process->owners = 0;
     process->msg_count = 0;
-    INIT_LIST_HEAD(&process->message_queue);
+    process->head = 0;
+    process->tail = 0;
+    process->capacity = 0;
+    process->ring = NULL;
+    process->mmap = NULL;
+    process->topic = NULL;
+    process->delivered = 0;
+    process->overwritten = 0;
+    process->dropped = 0;
+    process->max_depth = 0;
+    process->evicted = 0;
+    process->log_pos = 0;
     INIT_LIST_HEAD(&process->publish_node);
     INIT_LIST_HEAD(&process->subscriber_node);
 
-    printk(KERN_INFO "[CREATE_PROCESS] Process for PID '%d' created.\n", pid);
     return process;
 }
 
-process_s *find_process(int pid)
+/*
+ * Retorna a inscricao de 'pid' em 'topic' com uma referencia, ou NULL.
+ */
+process_s *topic_get_subscriber(topic_s *topic, int pid)
+{
+    process_s *entry;
+    process_s *found = NULL;
+
+    down_read(&topic->sub_lock);
+    list_for_each_entry(entry, &topic->process_subscribers, subscriber_node) {
+        if (entry->pid == pid) {
+            process_get(entry);
+            found = entry;
+            break;
+        }
+    }
+    up_read(&topic->sub_lock);
+    return found;
+}
+
+static int is_pid_registered(int pid, topic_s *topic, char list_type)
 {
-    topic_s *topic_entry;
-    process_s *process_entry;
+    if (list_type == 's') {
+        return is_pid_in_subscribers(pid, topic);
+    }
+    return is_pid_in_publishers(pid, topic);
+}
 
-    printk(KERN_INFO "[FIND_PROCESS] Searching for process with PID: %d.\n", pid);
+/* Registro de 'pid' na lista indicada, ou NULL. Chamada com sub_lock. */
+static process_s *find_registered(topic_s *topic, char list_type, int pid)
+{
+    process_s *entry;
 
-    list_for_each_entry(topic_entry, &my_broker.publish, publish_node) {
-        list_for_each_entry(process_entry, &topic_entry->process_publishers, publish_node) {
-            if (process_entry->pid == pid) {
-                printk(KERN_INFO "[FIND_PROCESS] Found PID %d as publisher in topic '%s'.\n", pid, topic_entry->name);
-                return process_entry;
+    if (list_type == 's') {
+        list_for_each_entry(entry, &topic->process_subscribers, subscriber_node) {
+            if (entry->pid == pid) {
+                return entry;
             }
         }
-        list_for_each_entry(process_entry, &topic_entry->process_subscribers, subscriber_node) {
-            if (process_entry->pid == pid) {
-                printk(KERN_INFO "[FIND_PROCESS] Found PID %d as subscriber in topic '%s'.\n", pid, topic_entry->name);
-                return process_entry;
+    } else {
+        list_for_each_entry(entry, &topic->process_publishers, publish_node) {
+            if (entry->pid == pid) {
+                return entry;
             }
         }
     }
+    return NULL;
+}
+
+/*
+ * 1 se o nome e um filtro com curingas, 0 se e um topico comum, -EINVAL se
+ * os curingas estao mal posicionados: '+' e '#' ocupam um nivel inteiro e
+ * '#' so pode ser o ultimo.
+ */
+static int topic_name_is_filter(const char *name)
+{
+    const char *seg = name;
+    const char *end;
+    size_t len;
+    int filter = 0;
+
+    for (;;) {
+        end = strchr(seg, '/');
+        len = end ? end - seg : strlen(seg);
 
-    list_for_each_entry(topic_entry, &my_broker.subscriber, subscribe_node) {
-        list_for_each_entry(process_entry, &topic_entry->process_subscribers, subscriber_node) {
-            if (process_entry->pid == pid) {
-                printk(KERN_INFO "[FIND_PROCESS] Found PID %d as subscriber in topic '%s'.\n", pid, topic_entry->name);
-                return process_entry;
+        if (memchr(seg, '+', len) || memchr(seg, '#', len)) {
+            if (len != 1) {
+                return -EINVAL;
             }
+            if (*seg == '#' && end) {
+                return -EINVAL;
+            }
+            filter = 1;
+        }
+        if (!end) {
+            return filter;
         }
-        list_for_each_entry(process_entry, &topic_entry->process_publishers, publish_node) {
-            if (process_entry->pid == pid) {
-                printk(KERN_INFO "[FIND_PROCESS] Found PID %d as publisher in topic '%s'.\n", pid, topic_entry->name);
-                return process_entry;
+        seg = end + 1;
+    }
+}
+
+/*
+ * Cria (se preciso) o caminho do filtro 'name' na trie e devolve o ultimo
+ * no, ou NULL sem memoria. O topico so e pendurado depois, pelo chamador:
+ * um caminho sem filtro nao casa com nada. Chamada com my_broker.lock; os
+ * leitores da trie nao pegam lock, entao os nos entram com list_add_rcu e
+ * nunca saem antes de broker_exit().
+ */
+static topic_node_s *trie_filter_node(const char *name)
+{
+    topic_node_s *node = &my_broker.filters;
+    topic_node_s *child;
+    const char *seg = name;
+    const char *end;
+    size_t len;
+
+    for (;;) {
+        end = strchr(seg, '/');
+        len = end ? end - seg : strlen(seg);
+
+        list_for_each_entry(child, &node->children, sibling) {
+            if (strlen(child->segment) == len && strncmp(child->segment, seg, len) == 0) {
+                goto found;
             }
         }
+
+        child = kzalloc(sizeof(*child), GFP_KERNEL);
+        if (!child) {
+            return NULL;
+        }
+        child->segment = kstrndup(seg, len, GFP_KERNEL);
+        if (!child->segment) {
+            kfree(child);
+            return NULL;
+        }
+        INIT_LIST_HEAD(&child->children);
+        list_add_tail_rcu(&child->sibling, &node->children);
+found:
+        node = child;
+        if (!end) {
+            break;
+        }
+        seg = end + 1;
     }
 
-    printk(KERN_WARNING "[FIND_PROCESS] Process with PID %d not found in any topic.\n", pid);
-    return NULL;
+    return node;
 }
 
-int register_process_to_topic(const char *topic_name, char list_type, int pid)
+static void trie_free(topic_node_s *node)
 {
-    topic_s *topic = find_topic(topic_name);
-    process_s *new_process;
+    topic_node_s *child, *next;
 
+    list_for_each_entry_safe(child, next, &node->children, sibling) {
+        trie_free(child);
+        list_del(&child->sibling);
+        kfree(child->segment);
+        kfree(child);
+    }
+}
+
+/*
+ * Topico pelo nome, criado se ainda nao existir; ERR_PTR em caso de erro.
+ * O handle numerico e alocado junto com a criacao, e filtros com '+'/'#'
+ * tambem entram na trie. Tudo que pode falhar vem antes de o topico ficar
+ * visivel (IDR, trie, tabela hash): dali em diante ele so sai em
+ * broker_exit(), entao os leitores sem lock nunca veem um topico liberado.
+ */
+topic_s *find_or_create_topic(const char *topic_name)
+{
+    topic_table_s *table;
+    topic_node_s *node = NULL;
+    topic_s *topic;
+    int id, is_filter;
+
+    topic = find_topic(topic_name);
+    if (topic) {
+        return topic;
+    }
+
+    is_filter = topic_name_is_filter(topic_name);
+    if (is_filter < 0) {
+        return ERR_PTR(is_filter);
+    }
+
+    mutex_lock(&my_broker.lock);
+    topic = find_topic(topic_name);
+    if (topic) {
+        goto out;
+    }
+
+    topic = create_topic(topic_name);
     if (!topic) {
-        topic = create_topic(topic_name);
-        if (!topic) {
-            return -ENOMEM;
-        }
-        insert_topic_to_broker(topic, list_type);
-    } else {
-        if (list_type == 'p' && list_empty(&topic->publish_node)) {
-            printk(KERN_INFO "[REGISTER] Linking existing topic '%s' to publish list.\n", topic_name);
-            list_add_tail(&topic->publish_node, &my_broker.publish);
-        } else if (list_type == 's' && list_empty(&topic->subscribe_node)) {
-            printk(KERN_INFO "[REGISTER] Linking existing topic '%s' to subscriber list.\n", topic_name);
-            list_add_tail(&topic->subscribe_node, &my_broker.subscriber);
-        }
+        topic = ERR_PTR(-ENOMEM);
+        goto out;
     }
+    topic->is_filter = is_filter;
 
-    if (list_type == 's') {
-        if (is_pid_in_subscribers(pid, topic)) {
-            printk(KERN_WARNING "[REGISTER] PID %d is already a subscriber of topic '%s'.\n", pid, topic->name);
-            return 0;
-        }
-    } else if (list_type == 'p') {
-        if (is_pid_in_publishers(pid, topic)) {
-            printk(KERN_WARNING "[REGISTER] PID %d is already a publisher of topic '%s'.\n", pid, topic->name);
-            return 0;
+    /* Um caminho que sobra na trie por falha abaixo nao casa com nada */
+    if (is_filter) {
+        node = trie_filter_node(topic->name);
+        if (!node) {
+            topic_free(topic);
+            topic = ERR_PTR(-ENOMEM);
+            goto out;
         }
     }
 
-    new_process = create_process(pid);
-    if (!new_process) {
-        return -ENOMEM;
+    id = idr_alloc(&my_broker.topic_ids, topic, 1, 0, GFP_KERNEL);
+    if (id < 0) {
+        topic_free(topic);
+        topic = ERR_PTR(id);
+        goto out;
     }
+    topic->id = id;
 
-    if (list_type == 's') {
-        list_add_tail(&new_process->subscriber_node, &topic->process_subscribers);
-        printk(KERN_INFO "[REGISTER] PID %d added as subscriber to topic '%s'.\n", pid, topic->name);
-    } else if (list_type == 'p') {
-        list_add_tail(&new_process->publish_node, &topic->process_publishers);
-        printk(KERN_INFO "[REGISTER] PID %d added as publisher to topic '%s'.\n", pid, topic->name);
-    } else {
-        printk(KERN_WARNING "[REGISTER] Invalid list type '%c' for PID %d.\n", list_type, pid);
-        kfree(new_process);
-        return -EINVAL;
+    if (node) {
+        smp_store_release(&node->filter, topic);
     }
+    table = rcu_dereference_protected(my_broker.topic_table, lockdep_is_held(&my_broker.lock));
+    hlist_add_head_rcu(&topic->hash_node[table->slot], topic_bucket(table, topic->hash));
+    my_broker.nr_topics++;
+    topic_table_grow(table);
 
-    return 0;
+out:
+    mutex_unlock(&my_broker.lock);
+    return topic;
+}
+
+/*
+ * Topico pelo handle devolvido no registro. Sem lock: topicos so saem do
+ * IDR em broker_exit().
+ */
+topic_s *find_topic_by_handle(u32 handle)
+{
+    topic_s *topic;
+
+    if (handle == 0 || handle > INT_MAX) {
+        return NULL;
+    }
+    rcu_read_lock();
+    topic = idr_find(&my_broker.topic_ids, handle);
+    rcu_read_unlock();
+    return topic;
 }
 
-int topic_publish_message(topic_s *topic, const char *message_data, short max_size)
+/* Liga o topico a lista do broker para o tipo de registro, se preciso */
+static void topic_link_to_broker(topic_s *topic, char list_type)
 {
-    process_s *subscriber_entry;
-    message_s *msg_container;
-    size_t data_size;
+    struct list_head *broker_node = list_type == 's' ? &topic->subscribe_node : &topic->publish_node;
 
-    if (!topic) {
-        printk(KERN_ERR "[PUBLISH] Cannot publish to a NULL topic.\n");
+    if (!list_empty(broker_node)) {
+        return;
+    }
+
+    mutex_lock(&my_broker.lock);
+    if (list_type == 'p' && list_empty(&topic->publish_node)) {
+        list_add_tail(&topic->publish_node, &my_broker.publish);
+    } else if (list_type == 's' && list_empty(&topic->subscribe_node)) {
+        list_add_tail(&topic->subscribe_node, &my_broker.subscriber);
+    }
+    mutex_unlock(&my_broker.lock);
+}
+
+/*
+ * Registra 'pid' como inscrito ('s') ou publicador ('p') de um topico ja
+ * resolvido. Registrar de novo nao e erro.
+ */
+int topic_register_process(topic_s *topic, char list_type, int pid)
+{
+    process_s *new_process;
+    int registered, mismatch;
+
+    if (list_type != 's' && list_type != 'p') {
+        printk(KERN_WARNING "[REGISTER] Invalid list type '%c' for PID %d.\n", list_type, pid);
         return -EINVAL;
     }
 
-    data_size = strnlen(message_data, max_size) + 1;
+    topic_link_to_broker(topic, list_type);
 
-    printk(KERN_INFO "[PUBLISH] Distributing message in topic '%s' to all subscribers.\n", topic->name);
+    down_read(&topic->sub_lock);
+    registered = is_pid_registered(pid, topic, list_type);
+    up_read(&topic->sub_lock);
 
-    list_for_each_entry(subscriber_entry, &topic->process_subscribers, subscriber_node) {
+    if (registered) {
+        /* Comum: todo /publish de texto passa por aqui */
+        return 0;
+    }
 
-        if (max_msg_n > 0 && subscriber_entry->msg_count >= max_msg_n) {
-            printk(KERN_INFO "  -> Mailbox for PID %d is full. Overwriting oldest message (circular).\n", subscriber_entry->pid);
+    new_process = create_process(pid);
+    if (!new_process) {
+        return -ENOMEM;
+    }
+    new_process->topic = topic;
 
-            msg_container = list_first_entry(&subscriber_entry->message_queue, message_s, link);
-            list_move_tail(&msg_container->link, &subscriber_entry->message_queue);
-            kfree(msg_container->message);
+    /* Em modo log o inscrito so guarda a posicao, sem mailbox */
+    if (list_type == 's' && !READ_ONCE(topic->log) && process_alloc_mailbox(new_process, max_msg_n)) {
+        printk(KERN_ERR "[REGISTER] Failed to allocate mailbox for PID %d.\n", pid);
+        process_put(new_process);
+        return -ENOMEM;
+    }
 
-        } else {
-            msg_container = kmalloc(sizeof(*msg_container), GFP_KERNEL);
-            if (!msg_container) {
-                printk(KERN_WARNING "  -> kmalloc failed for message container. Skipping PID %d.\n", subscriber_entry->pid);
-                continue;
-            }
-            
-            list_add_tail(&msg_container->link, &subscriber_entry->message_queue);
-            subscriber_entry->msg_count++;
-        }
+    down_write(&topic->sub_lock);
+    if (is_pid_registered(pid, topic, list_type)) {
+        /* Outra thread do mesmo processo chegou antes */
+        up_write(&topic->sub_lock);
+        process_put(new_process);
+        return 0;
+    }
 
-        msg_container->message = kmalloc(data_size, GFP_KERNEL);
-        if (!msg_container->message) {
-            printk(KERN_ERR "  -> kmalloc failed for message data. Removing container for PID %d.\n", subscriber_entry->pid);
-            list_del(&msg_container->link);
-            kfree(msg_container);
-            subscriber_entry->msg_count--;
-            continue;
+    if (list_type == 's') {
+        spin_lock(&topic->log_lock);
+        mismatch = (topic->log != NULL) == (new_process->ring != NULL);
+        new_process->log_pos = topic->log_head;
+        if (topic->retain && topic->log_head > 0) {
+            new_process->log_pos--;
+        }
+        spin_unlock(&topic->log_lock);
+        if (mismatch) {
+            /* O modo log mudou depois da alocacao acima */
+            up_write(&topic->sub_lock);
+            process_put(new_process);
+            return -EAGAIN;
         }
-        
-        strncpy(msg_container->message, message_data, data_size);
-        msg_container->size = data_size;
-        
-        printk(KERN_INFO "  -> Message delivered to PID %d. (Mailbox size: %d)\n", 
-               subscriber_entry->pid, subscriber_entry->msg_count);
+        if (new_process->ring && topic->retained) {
+            /* Com sub_lock para escrita nenhuma publicacao chega antes */
+            spin_lock(&new_process->mailbox_lock);
+            mailbox_push(new_process, topic->retained, PUBSUB_POLICY_OVERWRITE);
+            new_process->delivered++;
+            spin_unlock(&new_process->mailbox_lock);
+        }
+        list_add_tail(&new_process->subscriber_node, &topic->process_subscribers);
+        topic->nr_subscribers++;
+    } else {
+        list_add_tail(&new_process->publish_node, &topic->process_publishers);
     }
+    up_write(&topic->sub_lock);
+
+    trace_pubsub_register(topic->name, pid, list_type);
 
     return 0;
 }
 
-void topic_remove_subscriber(topic_s *topic, int pid) {
-    process_s *process, *temp;
-    message_s *msg, *msg_temp;
-
-    if (!topic) return;
+/*
+ * Registra 'pid' e conta o chamador como dono do registro. O dono e quem
+ * o desfaz: topic_release_process() quando o fd que o criou e fechado.
+ * Devolve o processo com uma referencia, ou ERR_PTR.
+ */
+process_s *topic_acquire_process(topic_s *topic, char list_type, int pid)
+{
+    process_s *process;
+    int ret;
 
-    list_for_each_entry_safe(process, temp, &topic->process_subscribers, subscriber_node) {
-        if (process->pid == pid) {
-            printk(KERN_INFO "[REMOVE_SUB] Removing subscriber PID %d from topic '%s'.\n", pid, topic->name);
-            
-            // Limpa a fila de mensagens individual antes de remover a inscrição
-            printk(KERN_INFO "  -> Cleaning up message queue for PID %d.\n", pid);
-            list_for_each_entry_safe(msg, msg_temp, &process->message_queue, link) {
-                list_del(&msg->link);
-                kfree(msg->message);
-                kfree(msg);
-            }
+    ret = topic_register_process(topic, list_type, pid);
+    if (ret) {
+        return ERR_PTR(ret);
+    }
 
-            list_del(&process->subscriber_node);
-            kfree(process);
-            return;
-        }
+    down_write(&topic->sub_lock);
+    process = find_registered(topic, list_type, pid);
+    if (process) {
+        process->owners++;
+        process_get(process);
     }
-    printk(KERN_WARNING "[REMOVE_SUB] Subscriber PID %d not found in topic '%s'.\n", pid, topic->name);
+    up_write(&topic->sub_lock);
+
+    /* Um /unsubscribe concorrente removeu o registro recem-criado */
+    return process ? process : ERR_PTR(-EAGAIN);
 }
 
-static void print_topic_details(topic_s *topic)
+int register_process_to_topic(const char *topic_name, char list_type, int pid, topic_s **topic_out)
 {
-    process_s *pub_entry;
-    process_s *sub_entry;
-    message_s *msg_entry;
+    topic_s *topic;
 
-    printk(KERN_INFO "-> Topic: \"%s\"\n", topic->name);
+    if (list_type != 's' && list_type != 'p') {
+        printk(KERN_WARNING "[REGISTER] Invalid list type '%c' for PID %d.\n", list_type, pid);
+        return -EINVAL;
+    }
 
-    printk(KERN_INFO "   - Publishers:");
-    if (list_empty(&topic->process_publishers)) {
-        printk(KERN_CONT " [None]\n");
-    } else {
-        printk(KERN_CONT "\n");
-        list_for_each_entry(pub_entry, &topic->process_publishers, publish_node) {
-            printk(KERN_INFO "     - PID: %d\n", pub_entry->pid);
-        }
+    topic = find_or_create_topic(topic_name);
+    if (IS_ERR(topic)) {
+        return PTR_ERR(topic);
     }
 
-    printk(KERN_INFO "   - Subscribers:");
-    if (list_empty(&topic->process_subscribers)) {
-        printk(KERN_CONT " [None]\n");
-    } else {
-        printk(KERN_CONT "\n");
-        list_for_each_entry(sub_entry, &topic->process_subscribers, subscriber_node) {
-            
-            printk(KERN_INFO "     - PID: %d (Mailbox Messages: %d)\n", sub_entry->pid, sub_entry->msg_count);
+    if (topic_out) {
+        *topic_out = topic;
+    }
+    return topic_register_process(topic, list_type, pid);
+}
 
-            if (!list_empty(&sub_entry->message_queue)) {
-                list_for_each_entry(msg_entry, &sub_entry->message_queue, link) {
-                    printk(KERN_INFO "       - \"%s\"\n", msg_entry->message);
-                }
-            }
-        }
+int process_alloc_mailbox(process_s *process, unsigned int capacity)
+{
+    process->ring = kcalloc(capacity, sizeof(*process->ring), GFP_KERNEL_ACCOUNT);
+    if (!process->ring) {
+        return -ENOMEM;
     }
+    process->capacity = capacity;
+    process->head = 0;
+    process->tail = 0;
+    process->msg_count = 0;
+    return 0;
 }
 
-void show_topics(void)
+static payload_s *__mailbox_pop(process_s *process)
 {
-    topic_s *entry;
+    payload_s *payload;
 
-    printk(KERN_INFO "\n=============== BROKER STATE ===============\n");
+    if (process->msg_count == 0) {
+        return NULL;
+    }
+
+    payload = process->ring[process->head].payload;
+    process->ring[process->head].payload = NULL;
+    process->head = (process->head + 1) % process->capacity;
+    process->msg_count--;
+    percpu_counter_dec(&queued_msgs);
+    return payload;
+}
+
+/* Topico do inscrito se ele esta em modo log, senao NULL */
+static topic_s *log_topic(process_s *process)
+{
+    topic_s *topic = process->topic;
+
+    return topic && READ_ONCE(topic->log) ? topic : NULL;
+}
+
+/* Sequencia mais antiga ainda no log. Chamada com log_lock. */
+static u64 log_first(topic_s *topic)
+{
+    return topic->log_head > topic->log_size ? topic->log_head - topic->log_size : 0;
+}
+
+/*
+ * mailbox_pop_if_fits() do modo log: le na posicao do inscrito sem tirar
+ * nada do log. ERR_PTR(-EOVERFLOW) se a posicao ja foi sobrescrita.
+ */
+static payload_s *log_pop_if_fits(topic_s *topic, process_s *process, size_t room, size_t *needed)
+{
+    payload_s *payload = NULL;
+
+    *needed = 0;
+    spin_lock(&topic->log_lock);
+    if (!topic->log) {
+        goto out;
+    }
+    if (process->log_pos < log_first(topic)) {
+        payload = ERR_PTR(-EOVERFLOW);
+    } else if (process->log_pos < topic->log_head) {
+        payload = topic->log[process->log_pos & (topic->log_size - 1)];
+        if (payload->size <= room) {
+            payload_get(payload);
+            process->log_pos++;
+        } else {
+            *needed = payload->size;
+            payload = NULL;
+        }
+    }
+out:
+    spin_unlock(&topic->log_lock);
+    return payload;
+}
+
+/* Mensagens entre a posicao e o fim; inclui as perdidas, para acordar o leitor */
+static unsigned int log_pending(topic_s *topic, process_s *process)
+{
+    u64 pending = 0;
+
+    spin_lock(&topic->log_lock);
+    if (topic->log && process->log_pos < topic->log_head) {
+        pending = topic->log_head - process->log_pos;
+    }
+    spin_unlock(&topic->log_lock);
+    return min_t(u64, pending, UINT_MAX);
+}
+
+/*
+ * Avisa publicadores bloqueados (politica PUBSUB_POLICY_BLOCK) de que
+ * abriu espaco em alguma mailbox do topico.
+ */
+static void topic_space_freed(topic_s *topic)
+{
+    if (READ_ONCE(topic->policy) != PUBSUB_POLICY_BLOCK) {
+        return;
+    }
+    atomic_inc(&topic->space_seq);
+    wake_up_all(&topic->space_wait);
+}
+
+/*
+ * Retira a mensagem mais antiga da mailbox. A referencia do payload passa
+ * para o chamador, que deve liberar com payload_put(). Em modo log pode
+ * devolver ERR_PTR(-EOVERFLOW), como mailbox_pop_if_fits().
+ */
+payload_s *mailbox_pop(process_s *process)
+{
+    topic_s *log = log_topic(process);
+    payload_s *payload;
+    size_t needed;
+
+    if (log) {
+        return log_pop_if_fits(log, process, SIZE_MAX, &needed);
+    }
+
+    spin_lock(&process->mailbox_lock);
+    payload = __mailbox_pop(process);
+    spin_unlock(&process->mailbox_lock);
+
+    if (payload) {
+        topic_space_freed(process->topic);
+    }
+    return payload;
+}
+
+/*
+ * Copia o payload para o proximo slot do anel mapeado. O consumidor e dono
+ * do tail, entao com o anel cheio a mensagem nova e descartada.
+ * Chamada com process->mailbox_lock.
+ */
+static int mmap_ring_push(mmap_ring_s *mmap, payload_s *payload)
+{
+    struct pubsub_mmap_slot *slot;
+    u32 tail = smp_load_acquire(&mmap->shared->tail);
+
+    if (mmap->head - tail >= mmap->slot_count ||
+        sizeof(*slot) + payload->size > mmap->slot_size) {
+        mmap->shared->dropped++;
+        return -ENOSPC;
+    }
+
+    slot = (void *)mmap->shared + PAGE_SIZE + (size_t)(mmap->head % mmap->slot_count) * mmap->slot_size;
+    slot->len = payload->size;
+    memcpy(slot->data, payload->data, payload->size);
+
+    mmap->head++;
+    smp_store_release(&mmap->shared->head, mmap->head);
+    return 0;
+}
+
+/*
+ * Aloca o anel compartilhado da inscricao (uma vez) e move para ele as
+ * mensagens que ja estavam na mailbox. Dali em diante as publicacoes vao
+ * direto para as paginas mapeadas.
+ */
+int process_attach_mmap_ring(process_s *process)
+{
+    mmap_ring_s *mmap;
+    payload_s *payload;
+    u32 slot_payload = max_msg_size > 0 ? max_msg_size : DEFAULT_MMAP_SLOT_PAYLOAD;
+    int ret;
+
+    if (log_topic(process)) {
+        /* O log e compartilhado; nao ha fila propria para mapear */
+        return -EINVAL;
+    }
+
+    if (READ_ONCE(process->mmap)) {
+        return 0;
+    }
+
+    mmap = kmalloc(sizeof(*mmap), GFP_KERNEL);
+    if (!mmap) {
+        return -ENOMEM;
+    }
+
+    mmap->head = 0;
+    mmap->slot_count = process->capacity;
+    mmap->slot_size = ALIGN(sizeof(struct pubsub_mmap_slot) + min_t(u32, slot_payload, MMAP_SLOT_PAYLOAD_MAX), 8);
+    mmap->size = PAGE_SIZE + PAGE_ALIGN((size_t)mmap->slot_count * mmap->slot_size);
+    /* vmalloc_user nao passa pelo memcg; o anel conta em max_queued_bytes */
+    ret = ring_charge(mmap->size);
+    if (ret) {
+        kfree(mmap);
+        return ret;
+    }
+    mmap->shared = vmalloc_user(mmap->size);
+    if (!mmap->shared) {
+        ring_uncharge(mmap->size);
+        kfree(mmap);
+        return -ENOMEM;
+    }
+    mmap->shared->slot_count = mmap->slot_count;
+    mmap->shared->slot_size = mmap->slot_size;
+    mmap->shared->data_offset = PAGE_SIZE;
+
+    spin_lock(&process->mailbox_lock);
+    if (process->mmap) {
+        spin_unlock(&process->mailbox_lock);
+        vfree(mmap->shared);
+        ring_uncharge(mmap->size);
+        kfree(mmap);
+        return 0;
+    }
+    process->mmap = mmap;
+    while ((payload = __mailbox_pop(process))) {
+        mmap_ring_push(mmap, payload);
+        payload_put(payload);
+    }
+    spin_unlock(&process->mailbox_lock);
+
+    return 0;
+}
+
+/*
+ * Mensagens esperando pelo consumidor, na mailbox ou no anel mapeado.
+ */
+unsigned int mailbox_pending(process_s *process)
+{
+    mmap_ring_s *mmap = READ_ONCE(process->mmap);
+    topic_s *log = log_topic(process);
+    u32 pending;
+
+    if (log) {
+        return log_pending(log, process);
+    }
+    if (!mmap) {
+        return READ_ONCE(process->msg_count);
+    }
+    pending = mmap->head - READ_ONCE(mmap->shared->tail);
+    return min(pending, mmap->slot_count);
+}
+
+/*
+ * Como mailbox_pop(), mas so retira a mensagem se ela tiver no maximo
+ * 'room' bytes. Caso contrario ela fica na mailbox e '*needed' recebe o
+ * seu tamanho (0 quando a mailbox esta vazia).
+ */
+payload_s *mailbox_pop_if_fits(process_s *process, size_t room, size_t *needed)
+{
+    topic_s *log = log_topic(process);
+    payload_s *payload = NULL;
+
+    if (log) {
+        return log_pop_if_fits(log, process, room, needed);
+    }
+
+    *needed = 0;
+    spin_lock(&process->mailbox_lock);
+    if (process->msg_count > 0) {
+        if (process->ring[process->head].payload->size <= room) {
+            payload = __mailbox_pop(process);
+        } else {
+            *needed = process->ring[process->head].payload->size;
+        }
+    }
+    spin_unlock(&process->mailbox_lock);
+
+    if (payload) {
+        topic_space_freed(process->topic);
+    }
+    return payload;
+}
+
+/* Tamanho da proxima mensagem da mailbox, 0 se vazia */
+size_t mailbox_next_size(process_s *process)
+{
+    topic_s *log = log_topic(process);
+    size_t size = 0;
+
+    if (log) {
+        spin_lock(&log->log_lock);
+        if (log->log && process->log_pos >= log_first(log) && process->log_pos < log->log_head) {
+            size = log->log[process->log_pos & (log->log_size - 1)]->size;
+        }
+        spin_unlock(&log->log_lock);
+        return size;
+    }
+
+    spin_lock(&process->mailbox_lock);
+    if (process->msg_count > 0) {
+        size = process->ring[process->head].payload->size;
+    }
+    spin_unlock(&process->mailbox_lock);
+    return size;
+}
+
+/*
+ * Condicao de espera dos leitores: ha mensagem ou a inscricao acabou.
+ */
+int mailbox_readable(process_s *process)
+{
+    topic_s *log = log_topic(process);
+
+    if (log) {
+        return log_pending(log, process) > 0 || READ_ONCE(process->removed);
+    }
+    return READ_ONCE(process->msg_count) > 0 || READ_ONCE(process->removed);
+}
+
+/*
+ * Onde o leitor espera por mailbox_readable(). Em modo log a publicacao
+ * acorda so a fila do topico, em vez de uma por inscrito.
+ */
+wait_queue_head_t *mailbox_waitq(process_s *process)
+{
+    topic_s *log = log_topic(process);
+
+    return log ? &log->poll_wait : &process->wait;
+}
+
+/*
+ * lseek() de um inscrito em modo log. A nova posicao tem de estar no log:
+ * entre a mensagem mais antiga e o fim. -ESPIPE fora do modo log.
+ */
+loff_t topic_log_seek(process_s *process, loff_t offset, int whence)
+{
+    topic_s *topic = process->topic;
+    loff_t base, pos;
+
+    spin_lock(&topic->log_lock);
+    if (!topic->log) {
+        pos = -ESPIPE;
+        goto out;
+    }
+
+    switch (whence) {
+    case SEEK_SET:
+        base = 0;
+        break;
+    case SEEK_CUR:
+        base = process->log_pos;
+        break;
+    case SEEK_END:
+        base = topic->log_head;
+        break;
+    default:
+        pos = -EINVAL;
+        goto out;
+    }
+
+    if (offset > 0 && base > LLONG_MAX - offset) {
+        pos = -EINVAL;
+        goto out;
+    }
+    pos = base + offset;
+    if (pos < (loff_t)log_first(topic) || pos > (loff_t)topic->log_head) {
+        pos = -EINVAL;
+        goto out;
+    }
+    process->log_pos = pos;
+
+out:
+    spin_unlock(&topic->log_lock);
+    return pos;
+}
+
+int topic_log_status(process_s *process, struct pubsub_log_status *status)
+{
+    topic_s *topic = process->topic;
+    int ret = 0;
+
+    spin_lock(&topic->log_lock);
+    if (!topic->log) {
+        ret = -EINVAL;
+    } else {
+        status->position = process->log_pos;
+        status->first = log_first(topic);
+        status->head = topic->log_head;
+        status->lost = status->position < status->first ? status->first - status->position : 0;
+    }
+    spin_unlock(&topic->log_lock);
+    return ret;
+}
+
+/*
+ * Coloca o payload na cauda do anel. Com a mailbox cheia, na politica
+ * circular o slot mais antigo e sobrescrito e a funcao retorna 1; nas
+ * outras a mensagem nova e descartada e a funcao retorna -1 (no modo
+ * bloqueante o publicador ja esperou por espaco, entao so acontece se a
+ * politica mudou no meio). Chamada com process->mailbox_lock.
+ */
+static int mailbox_push(process_s *process, payload_s *payload, int policy)
+{
+    int overwritten = 0;
+
+    if (process->msg_count >= process->capacity) {
+        if (policy != PUBSUB_POLICY_OVERWRITE) {
+            return -1;
+        }
+        payload_put(__mailbox_pop(process));
+        overwritten = 1;
+    }
+
+    payload_get(payload);
+    process->ring[process->tail].payload = payload;
+    process->tail = (process->tail + 1) % process->capacity;
+    process->msg_count++;
+    percpu_counter_inc(&queued_msgs);
+    return overwritten;
+}
+
+static void mailbox_drain(process_s *process)
+{
+    while (process->msg_count > 0) {
+        payload_put(__mailbox_pop(process));
+    }
+}
+
+void process_get(process_s *process)
+{
+    kref_get(&process->ref);
+}
+
+static void process_release(struct kref *ref)
+{
+    process_s *process = container_of(ref, process_s, ref);
+
+    mailbox_drain(process);
+    kfree(process->ring);
+    if (process->mmap) {
+        vfree(process->mmap->shared);
+        ring_uncharge(process->mmap->size);
+        kfree(process->mmap);
+    }
+    kmem_cache_free(process_cache, process);
+}
+
+void process_put(process_s *process)
+{
+    kref_put(&process->ref, process_release);
+}
+
+static unsigned int hist_bucket(u64 ns)
+{
+    unsigned int bucket = ns ? ilog2(ns) : 0;
+
+    return min_t(unsigned int, bucket, BROKER_HIST_BUCKETS - 1);
+}
+
+static int payload_class(size_t size)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(payload_class_size); i++) {
+        if (sizeof(payload_s) + size <= payload_class_size[i]) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Aloca um payload de 'size' bytes sem inicializar os dados, para quem vai
+ * preenche-lo direto (ex.: copy_from_user no ioctl de publish). Retorna
+ * NULL tambem quando a mensagem estouraria max_queued_bytes: o publicador
+ * recebe o erro em vez de a maquina ir para o OOM.
+ */
+payload_s *payload_alloc(size_t size)
+{
+    payload_s *payload;
+    int class = payload_class(size);
+    s64 charge = sizeof(*payload) + size;
+
+    if (memory_charge(charge)) {
+        return NULL;
+    }
+
+    if (class >= 0) {
+        payload = kmem_cache_alloc(payload_cache[class], GFP_KERNEL);
+    } else {
+        payload = kvmalloc(sizeof(*payload) + size, GFP_KERNEL_ACCOUNT);
+    }
+    if (!payload) {
+        memory_uncharge(charge);
+        return NULL;
+    }
+
+    kref_init(&payload->ref);
+    payload->size = size;
+    return payload;
+}
+
+payload_s *payload_create(const char *data, size_t size)
+{
+    payload_s *payload = payload_alloc(size);
+
+    if (payload) {
+        memcpy(payload->data, data, size);
+    }
+    return payload;
+}
+
+void payload_get(payload_s *payload)
+{
+    kref_get(&payload->ref);
+}
+
+static void payload_release(struct kref *ref)
+{
+    payload_s *payload = container_of(ref, payload_s, ref);
+    int class = payload_class(payload->size);
+
+    memory_uncharge(payload_charge(payload));
+    if (class >= 0) {
+        kmem_cache_free(payload_cache[class], payload);
+    } else if (is_vmalloc_addr(payload)) {
+        /* O ultimo payload_put() pode vir de dentro de um spinlock */
+        vfree_atomic(payload);
+    } else {
+        kfree(payload);
+    }
+}
+
+void payload_put(payload_s *payload)
+{
+    kref_put(&payload->ref, payload_release);
+}
+
+typedef struct {
+    u64 delivered;
+    u64 overwritten;
+    u64 dropped;
+} fanout_totals_s;
+
+/*
+ * Entrega a ate 'nr' inscritos a partir de 'first' (que pode ser a propria
+ * cabeca da lista, se ela estiver vazia). O chamador segura sub_lock para
+ * leitura, tambem em nome das fatias.
+ */
+static void deliver_range(topic_s *topic, payload_s **payloads, unsigned int count, int policy,
+                          process_s *first, unsigned int nr, fanout_totals_s *totals)
+{
+    process_s *subscriber_entry = first;
+    int overwritten, dropped, pushed;
+    unsigned int mailbox_size;
+    unsigned int i;
+
+    list_for_each_entry_from(subscriber_entry, &topic->process_subscribers, subscriber_node) {
+        if (nr-- == 0) {
+            break;
+        }
+        overwritten = 0;
+        dropped = 0;
+
+        spin_lock(&subscriber_entry->mailbox_lock);
+        for (i = 0; i < count; i++) {
+            if (subscriber_entry->mmap) {
+                dropped += mmap_ring_push(subscriber_entry->mmap, payloads[i]) != 0;
+            } else {
+                pushed = mailbox_push(subscriber_entry, payloads[i], policy);
+                if (pushed > 0) {
+                    overwritten++;
+                } else if (pushed < 0) {
+                    dropped++;
+                }
+            }
+        }
+        mailbox_size = mailbox_pending(subscriber_entry);
+        subscriber_entry->delivered += count - dropped;
+        subscriber_entry->overwritten += overwritten;
+        subscriber_entry->dropped += dropped;
+        if (mailbox_size > subscriber_entry->max_depth) {
+            subscriber_entry->max_depth = mailbox_size;
+        }
+        spin_unlock(&subscriber_entry->mailbox_lock);
+
+        totals->delivered += count - dropped;
+        totals->overwritten += overwritten;
+        totals->dropped += dropped;
+
+        wake_up_interruptible(&subscriber_entry->wait);
+
+        trace_pubsub_deliver(topic->name, subscriber_entry->pid, count, overwritten, dropped, mailbox_size);
+    }
+}
+
+typedef struct {
+    struct work_struct work;
+    topic_s *topic;
+    payload_s **payloads;
+    unsigned int count;
+    int policy;
+    process_s *first;
+    unsigned int nr;
+    fanout_totals_s totals;
+    struct completion done;
+} fanout_shard_s;
+
+static void fanout_shard_work(struct work_struct *work)
+{
+    fanout_shard_s *shard = container_of(work, fanout_shard_s, work);
+
+    deliver_range(shard->topic, shard->payloads, shard->count, shard->policy,
+                  shard->first, shard->nr, &shard->totals);
+    complete(&shard->done);
+}
+
+/*
+ * Reparte a lista em fatias na shard_wq e faz a primeira aqui mesmo. A
+ * lista e percorrida uma vez so, para achar o inicio de cada fatia; a
+ * fatia comeca ali em vez de pular os inscritos anteriores. Sem memoria
+ * para as fatias, entrega tudo sozinho.
+ */
+static void deliver_sharded(topic_s *topic, payload_s **payloads, unsigned int count, int policy,
+                            unsigned int nr, unsigned int nr_shards, fanout_totals_s *totals)
+{
+    fanout_shard_s *shards;
+    process_s *cursor = list_first_entry(&topic->process_subscribers, process_s, subscriber_node);
+    unsigned int per_shard = DIV_ROUND_UP(nr, nr_shards);
+    unsigned int i, j;
+
+    shards = kcalloc(nr_shards, sizeof(*shards), GFP_KERNEL);
+    if (!shards) {
+        deliver_range(topic, payloads, count, policy, cursor, UINT_MAX, totals);
+        return;
+    }
+
+    for (i = 0; i < nr_shards; i++) {
+        shards[i].topic = topic;
+        shards[i].payloads = payloads;
+        shards[i].count = count;
+        shards[i].policy = policy;
+        shards[i].first = cursor;
+        shards[i].nr = i == nr_shards - 1 ? UINT_MAX : per_shard;
+        for (j = 0; j < per_shard && &cursor->subscriber_node != &topic->process_subscribers; j++) {
+            cursor = list_next_entry(cursor, subscriber_node);
+        }
+        init_completion(&shards[i].done);
+        INIT_WORK(&shards[i].work, fanout_shard_work);
+        if (i > 0) {
+            queue_work(shard_wq, &shards[i].work);
+        }
+    }
+
+    fanout_shard_work(&shards[0].work);
+    for (i = 0; i < nr_shards; i++) {
+        wait_for_completion(&shards[i].done);
+        totals->delivered += shards[i].totals.delivered;
+        totals->overwritten += shards[i].totals.overwritten;
+        totals->dropped += shards[i].totals.dropped;
+    }
+    kfree(shards);
+}
+
+/*
+ * Guarda o ultimo payload do lote para os proximos inscritos. Chamada com
+ * sub_lock para leitura: quem se inscreve depois recebe a mensagem por
+ * aqui, quem ja estava recebe pela entrega, nunca as duas.
+ */
+static void topic_retain(topic_s *topic, payload_s *payload)
+{
+    payload_s *old;
+
+    if (!READ_ONCE(topic->retain)) {
+        return;
+    }
+    payload_get(payload);
+    old = xchg(&topic->retained, payload);
+    if (old) {
+        payload_put(old);
+    }
+}
+
+/*
+ * Entrega 'count' payloads, em ordem, a todos os inscritos do topico. A
+ * lista de inscritos e o lock de cada mailbox sao pegos uma vez para o
+ * lote inteiro. Cada mailbox pega suas proprias referencias; as do
+ * chamador continuam sendo dele. Em topicos assincronos roda na fanout_wq
+ * e, com listas grandes, em varias CPUs.
+ */
+static void topic_deliver(topic_s *topic, payload_s **payloads, unsigned int count, size_t bytes)
+{
+    fanout_totals_s totals = { 0 };
+    unsigned int nr_shards = 1;
+    u64 start;
+    int policy = READ_ONCE(topic->policy);
+
+    start = ktime_get_ns();
+    trace_pubsub_publish(topic->name, count, bytes);
+
+    down_read(&topic->sub_lock);
+    topic_retain(topic, payloads[count - 1]);
+    if (READ_ONCE(topic->async) && topic->nr_subscribers >= 2 * FANOUT_SHARD_MIN) {
+        nr_shards = min3(num_online_cpus(), topic->nr_subscribers / FANOUT_SHARD_MIN,
+                         (unsigned int)FANOUT_MAX_SHARDS);
+    }
+    if (nr_shards > 1) {
+        deliver_sharded(topic, payloads, count, policy, topic->nr_subscribers, nr_shards, &totals);
+    } else {
+        deliver_range(topic, payloads, count, policy,
+                      list_first_entry(&topic->process_subscribers, process_s, subscriber_node),
+                      UINT_MAX, &totals);
+    }
+    up_read(&topic->sub_lock);
+
+    this_cpu_add(topic->stats->published, count);
+    this_cpu_add(topic->stats->bytes, bytes);
+    this_cpu_add(topic->stats->delivered, totals.delivered);
+    this_cpu_add(topic->stats->overwritten, totals.overwritten);
+    this_cpu_add(topic->stats->dropped, totals.dropped);
+    this_cpu_inc(topic->stats->fanout_latency[hist_bucket(ktime_get_ns() - start)]);
+
+    wake_up_interruptible(&topic->poll_wait);
+}
+
+/*
+ * 1 se todas as mailboxes do topico cabem mais 'count' mensagens. Aneis
+ * mmap nao entram: o consumidor move o tail sem passar pelo kernel, entao
+ * nao haveria quem acordasse o publicador; ali a mensagem e descartada.
+ */
+static int topic_has_room(topic_s *topic, unsigned int count)
+{
+    process_s *sub;
+    int room = 1;
+
+    down_read(&topic->sub_lock);
+    list_for_each_entry(sub, &topic->process_subscribers, subscriber_node) {
+        if (READ_ONCE(sub->mmap)) {
+            continue;
+        }
+        if (READ_ONCE(sub->msg_count) + count > sub->capacity) {
+            room = 0;
+            break;
+        }
+    }
+    up_read(&topic->sub_lock);
+    return room;
+}
+
+/*
+ * Modo log: uma referencia por mensagem no anel do topico, qualquer que
+ * seja o numero de inscritos. A mais antiga sai quando o anel enche; quem
+ * ainda nao a leu descobre pelo -EOVERFLOW.
+ */
+static void topic_log_append(topic_s *topic, payload_s **payloads, unsigned int count, size_t bytes)
+{
+    payload_s **slot;
+    u64 overwritten = 0;
+    unsigned int i;
+    u64 start;
+
+    start = ktime_get_ns();
+    trace_pubsub_publish(topic->name, count, bytes);
+
+    spin_lock(&topic->log_lock);
+    if (!topic->log) {
+        /* Modo desligado agora ha pouco; so acontece sem inscritos */
+        spin_unlock(&topic->log_lock);
+        return;
+    }
+    for (i = 0; i < count; i++) {
+        slot = &topic->log[topic->log_head & (topic->log_size - 1)];
+        if (*slot) {
+            payload_put(*slot);
+            overwritten++;
+        }
+        payload_get(payloads[i]);
+        *slot = payloads[i];
+        topic->log_head++;
+    }
+    spin_unlock(&topic->log_lock);
+
+    this_cpu_add(topic->stats->published, count);
+    this_cpu_add(topic->stats->bytes, bytes);
+    this_cpu_add(topic->stats->delivered, count);
+    this_cpu_add(topic->stats->overwritten, overwritten);
+    this_cpu_inc(topic->stats->fanout_latency[hist_bucket(ktime_get_ns() - start)]);
+
+    wake_up_interruptible(&topic->poll_wait);
+}
+
+/*
+ * Filhos de um no da trie, sem rcu_read_lock: a entrega pode dormir
+ * (BLOCK). Nao precisa: os nos entram ja inicializados por
+ * list_add_tail_rcu(), que publica o ponteiro com barreira, e so sao
+ * liberados em broker_exit(). Basta ler cada ->next com READ_ONCE.
+ */
+#define trie_for_each_child(child, node)                                            \
+    for (child = list_entry(READ_ONCE((node)->children.next), topic_node_s, sibling); \
+         &child->sibling != &(node)->children;                                      \
+         child = list_entry(READ_ONCE(child->sibling.next), topic_node_s, sibling))
+
+/*
+ * Destinos de uma publicacao: o topico e os filtros que casam com o nome.
+ * Cada no da trie e visitado no maximo uma vez por nome, entao nenhum
+ * topico aparece duas vezes.
+ */
+#define PUBLISH_INLINE_TARGETS 8
+
+typedef struct {
+    topic_s *topic;
+    int blocking;       /* BLOCK: dono de topic->block_busy durante a entrega */
+} publish_target_s;
+
+typedef struct {
+    publish_target_s *entries;
+    unsigned int count;
+    unsigned int capacity;
+    publish_target_s inline_entries[PUBLISH_INLINE_TARGETS];
+} publish_targets_s;
+
+static int targets_add(publish_targets_s *targets, topic_s *topic)
+{
+    publish_target_s *grown;
+
+    if (targets->count == targets->capacity) {
+        grown = kmalloc_array(targets->capacity * 2, sizeof(*grown), GFP_KERNEL);
+        if (!grown) {
+            return -ENOMEM;
+        }
+        memcpy(grown, targets->entries, targets->count * sizeof(*grown));
+        if (targets->entries != targets->inline_entries) {
+            kfree(targets->entries);
+        }
+        targets->entries = grown;
+        targets->capacity *= 2;
+    }
+    targets->entries[targets->count].topic = topic;
+    targets->entries[targets->count].blocking = 0;
+    targets->count++;
+    return 0;
+}
+
+/*
+ * Percorre a trie de filtros seguindo os segmentos de 'rest' (NULL quando
+ * todos ja foram consumidos) e junta em 'targets' cada filtro que casa. Em
+ * cada nivel so os filhos com o segmento exato, '+' e '#' sao visitados,
+ * entao o custo depende da profundidade do nome, nao do numero de filtros.
+ * 'literal_only' ignora '+'/'#' neste nivel (nomes com '$' na raiz).
+ */
+static int trie_collect(topic_node_s *node, const char *rest, int literal_only, publish_targets_s *targets)
+{
+    topic_node_s *child;
+    topic_s *filter;
+    const char *next;
+    size_t seg_len;
+    int ret = 0;
+
+    if (rest) {
+        next = strchr(rest, '/');
+        seg_len = next ? next - rest : strlen(rest);
+        if (next) {
+            next++;
+        }
+    } else {
+        next = NULL;
+        seg_len = 0;
+    }
+
+    trie_for_each_child(child, node) {
+        filter = smp_load_acquire(&child->filter);
+
+        if (strcmp(child->segment, "#") == 0) {
+            /* '#' casa o resto do nome, inclusive nenhum nivel */
+            if (filter && !literal_only) {
+                ret = targets_add(targets, filter);
+            }
+        } else if (rest &&
+                   ((strcmp(child->segment, "+") == 0 && !literal_only) ||
+                    (strlen(child->segment) == seg_len && strncmp(child->segment, rest, seg_len) == 0))) {
+            if (next) {
+                ret = trie_collect(child, next, 0, targets);
+            } else {
+                if (filter) {
+                    ret = targets_add(targets, filter);
+                }
+                /* Nome acabou neste filho: ainda pode haver 'x/#' abaixo */
+                if (!ret) {
+                    ret = trie_collect(child, NULL, 0, targets);
+                }
+            }
+        }
+
+        if (ret) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+static void target_unclaim(topic_s *topic)
+{
+    clear_bit_unlock(TOPIC_BLOCK_BUSY, &topic->block_busy);
+    wake_up_all(&topic->space_wait);
+}
+
+/*
+ * Pega block_busy de todos os destinos BLOCK, esperando no maximo
+ * '*remaining'. Se um estiver ocupado, solta os ja pegos antes de esperar:
+ * dois publicadores com destinos em comum nunca esperam um pelo outro em
+ * ciclo.
+ */
+static int targets_claim(publish_targets_s *targets, long *remaining)
+{
+    topic_s *busy;
+    unsigned int i, j;
+
+    for (;;) {
+        busy = NULL;
+        for (i = 0; i < targets->count; i++) {
+            if (targets->entries[i].blocking &&
+                test_and_set_bit_lock(TOPIC_BLOCK_BUSY, &targets->entries[i].topic->block_busy)) {
+                busy = targets->entries[i].topic;
+                break;
+            }
+        }
+        if (!busy) {
+            return 0;
+        }
+
+        for (j = 0; j < i; j++) {
+            if (targets->entries[j].blocking) {
+                target_unclaim(targets->entries[j].topic);
+            }
+        }
+        if (*remaining <= 0) {
+            return -EAGAIN;
+        }
+        *remaining = wait_event_interruptible_timeout(busy->space_wait,
+                                                      !test_bit(TOPIC_BLOCK_BUSY, &busy->block_busy),
+                                                      *remaining);
+        if (*remaining < 0) {
+            return *remaining;
+        }
+    }
+}
+
+static void targets_unclaim(publish_targets_s *targets)
+{
+    unsigned int i;
+
+    for (i = 0; i < targets->count; i++) {
+        if (targets->entries[i].blocking) {
+            target_unclaim(targets->entries[i].topic);
+        }
+    }
+}
+
+/*
+ * Espera ate todos os destinos BLOCK terem espaco para 'count'. Com
+ * block_busy so este publicador entrega neles e consumidores so liberam
+ * espaco, entao um destino que ja tinha espaco continua tendo enquanto se
+ * espera pelos outros.
+ */
+static int targets_wait_room(publish_targets_s *targets, unsigned int count, long *remaining)
+{
+    topic_s *topic;
+    unsigned int i;
+    int seq;
+
+    for (i = 0; i < targets->count; i++) {
+        if (!targets->entries[i].blocking) {
+            continue;
+        }
+        topic = targets->entries[i].topic;
+        for (;;) {
+            seq = atomic_read(&topic->space_seq);
+            if (topic_has_room(topic, count)) {
+                break;
+            }
+            if (*remaining <= 0) {
+                return -EAGAIN;
+            }
+            *remaining = wait_event_interruptible_timeout(topic->space_wait,
+                                                          atomic_read(&topic->space_seq) != seq,
+                                                          *remaining);
+            if (*remaining < 0) {
+                return *remaining;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * Entrega o pedaco a cada destino. O total de bytes, que vai para as
+ * estatisticas e para o tracepoint de cada destino, e somado uma vez so.
+ */
+static void targets_deliver(publish_targets_s *targets, payload_s **payloads, unsigned int count)
+{
+    topic_s *topic;
+    unsigned int i;
+    size_t bytes = 0;
+
+    for (i = 0; i < count; i++) {
+        bytes += payloads[i]->size;
+    }
+    for (i = 0; i < targets->count; i++) {
+        topic = targets->entries[i].topic;
+        if (READ_ONCE(topic->log)) {
+            topic_log_append(topic, payloads, count, bytes);
+        } else {
+            topic_deliver(topic, payloads, count, bytes);
+        }
+    }
+}
+
+/*
+ * Entrega ao topico e aos filtros que casam com o nome. Se algum destino
+ * usa PUBSUB_POLICY_BLOCK, cada pedaco de ate max_msg_n mensagens (o que
+ * cabe numa mailbox) so sai quando ha espaco em todos os destinos BLOCK:
+ * todos recebem ou nenhum recebe. O prazo e o menor block_timeout_ms
+ * entre eles e conta tambem a espera por outros publicadores.
+ *
+ * Sem 'can_wait' (fan-out assincrono) o prazo e zero: um destino BLOCK
+ * cheio ou ocupado faz o pedaco falhar na hora, sem prender o kworker.
+ *
+ * Retorna quantos payloads foram entregues; menos que 'count' so quando o
+ * prazo acaba depois de algum pedaco. Sem nada entregue, o erro.
+ */
+static int topic_publish_now(topic_s *topic, payload_s **payloads, unsigned int count, int can_wait)
+{
+    publish_targets_s targets;
+    publish_target_s *target;
+    unsigned int timeout_ms = UINT_MAX;
+    unsigned int done = 0, n, i;
+    int blocking = 0;
+    long remaining;
+    int ret;
+
+    targets.entries = targets.inline_entries;
+    targets.count = 0;
+    targets.capacity = PUBLISH_INLINE_TARGETS;
+
+    ret = targets_add(&targets, topic);
+    if (!ret) {
+        /* Topicos iniciados por '$' nao casam com curingas no primeiro nivel */
+        ret = trie_collect(&my_broker.filters, topic->name, topic->name[0] == '$', &targets);
+    }
+    if (ret) {
+        goto out;
+    }
+
+    for (i = 0; i < targets.count; i++) {
+        target = &targets.entries[i];
+        /* Em modo log a politica nao se aplica */
+        target->blocking = READ_ONCE(target->topic->policy) == PUBSUB_POLICY_BLOCK &&
+                           !READ_ONCE(target->topic->log);
+        if (target->blocking) {
+            blocking = 1;
+            timeout_ms = min(timeout_ms, READ_ONCE(target->topic->block_timeout_ms));
+        }
+    }
+
+    if (!blocking) {
+        targets_deliver(&targets, payloads, count);
+        ret = count;
+        goto out;
+    }
+
+    remaining = can_wait ? msecs_to_jiffies(timeout_ms) : 0;
+    ret = targets_claim(&targets, &remaining);
+    if (ret) {
+        goto out;
+    }
+    while (done < count) {
+        n = min_t(unsigned int, count - done, max_msg_n);
+        ret = targets_wait_room(&targets, n, &remaining);
+        if (ret) {
+            break;
+        }
+        targets_deliver(&targets, payloads + done, n);
+        done += n;
+    }
+    targets_unclaim(&targets);
+    if (done) {
+        ret = done;
+    }
+
+out:
+    if (targets.entries != targets.inline_entries) {
+        kfree(targets.entries);
+    }
+    return ret;
+}
+
+/*
+ * Enfileira o lote para a fanout_wq, com uma referencia por payload. A
+ * memoria dos lotes parados na fila conta em max_queued_bytes como a das
+ * mailboxes, entao a fila nao cresce sem limite.
+ */
+static int topic_queue_async(topic_s *topic, payload_s **payloads, unsigned int count)
+{
+    async_batch_s *batch;
+    unsigned int i;
+
+    batch = kmalloc(sizeof(*batch) + count * sizeof(batch->payloads[0]), GFP_KERNEL);
+    if (!batch) {
+        return -ENOMEM;
+    }
+    batch->count = count;
+    for (i = 0; i < count; i++) {
+        payload_get(payloads[i]);
+        batch->payloads[i] = payloads[i];
+    }
+
+    spin_lock(&topic->async_lock);
+    batch->seq = ++topic->async_queued;
+    list_add_tail(&batch->node, &topic->async_queue);
+    spin_unlock(&topic->async_lock);
+    queue_work(fanout_wq, &topic->async_work);
+    return 0;
+}
+
+/*
+ * Esvazia a fila assincrona do topico. Um work por topico nunca roda em
+ * duas CPUs ao mesmo tempo, entao os lotes saem na ordem de chegada.
+ */
+static void topic_async_work(struct work_struct *work)
+{
+    topic_s *topic = container_of(work, topic_s, async_work);
+    async_batch_s *batch, *next;
+    LIST_HEAD(batches);
+    unsigned int i;
+    int ret;
+
+    spin_lock(&topic->async_lock);
+    list_splice_init(&topic->async_queue, &batches);
+    spin_unlock(&topic->async_lock);
+
+    list_for_each_entry_safe(batch, next, &batches, node) {
+        list_del(&batch->node);
+        /*
+         * Sem BLOCK neste modo, e filtros BLOCK nao esperam aqui: a espera
+         * prenderia um kworker da fanout_wq. Nao ha publicador para
+         * receber o erro, entao o que nao saiu conta como descartado.
+         */
+        ret = topic_publish_now(topic, batch->payloads, batch->count, 0);
+        if (ret < (int)batch->count) {
+            this_cpu_add(topic->stats->dropped, batch->count - max(ret, 0));
+        }
+        for (i = 0; i < batch->count; i++) {
+            payload_put(batch->payloads[i]);
+        }
+
+        /* Um work por topico: async_done so avanca aqui, em ordem */
+        smp_store_release(&topic->async_done, batch->seq);
+        kfree(batch);
+        wake_up_all(&topic->async_wait);
+    }
+}
+
+/*
+ * Espera as publicacoes assincronas ja aceitas serem entregues. So conta
+ * o que estava na fila na chamada: com publicadores continuos a fila pode
+ * nunca esvaziar.
+ */
+int topic_flush(topic_s *topic)
+{
+    unsigned long seq;
+
+    spin_lock(&topic->async_lock);
+    seq = topic->async_queued;
+    spin_unlock(&topic->async_lock);
+
+    if (wait_event_interruptible(topic->async_wait,
+                                 (long)(smp_load_acquire(&topic->async_done) - seq) >= 0)) {
+        return -ERESTARTSYS;
+    }
+    return 0;
+}
+
+/*
+ * Publica 'count' payloads no topico. Retorna quantos foram entregues (ou
+ * enfileirados, no modo assincrono) ou erro se nenhum foi; ver
+ * topic_publish_now() para quando sai menos que 'count'.
+ */
+int topic_publish_payloads(topic_s *topic, payload_s **payloads, unsigned int count)
+{
+    unsigned int i;
+    u64 now;
+    int ret;
+
+    if (!topic) {
+        printk(KERN_ERR "[PUBLISH] Cannot publish to a NULL topic.\n");
+        return -EINVAL;
+    }
+    if (topic->is_filter) {
+        /* Filtros com '+'/'#' so servem para inscricao */
+        return -EINVAL;
+    }
+
+    now = ktime_get_ns();
+    for (i = 0; i < count; i++) {
+        payloads[i]->enqueue_ns = now;
+    }
+
+    if (READ_ONCE(topic->async)) {
+        ret = topic_queue_async(topic, payloads, count);
+        return ret ? ret : count;
+    }
+    return topic_publish_now(topic, payloads, count, 1);
+}
+
+/*
+ * Liga (entries > 0) ou desliga o modo log. Inscritos existentes tem
+ * mailbox ou posicao conforme o modo em que entraram, entao so muda com o
+ * topico vazio. O historico anterior e descartado.
+ */
+static int topic_set_log(topic_s *topic, unsigned int entries)
+{
+    unsigned int size = entries ? roundup_pow_of_two(entries) : 0;
+    unsigned int old_size;
+    payload_s **log = NULL, **old;
+    payload_s *retained;
+
+    if (size) {
+        log = kvmalloc_array(size, sizeof(*log), GFP_KERNEL_ACCOUNT | __GFP_ZERO);
+        if (!log) {
+            return -ENOMEM;
+        }
+    }
+
+    down_write(&topic->sub_lock);
+    if (topic->nr_subscribers) {
+        up_write(&topic->sub_lock);
+        kvfree(log);
+        return -EBUSY;
+    }
+    spin_lock(&topic->log_lock);
+    old = topic->log;
+    old_size = topic->log_size;
+    topic->log = log;
+    topic->log_size = size;
+    topic->log_head = 0;
+    spin_unlock(&topic->log_lock);
+    /* A mensagem guardada tambem e historico */
+    retained = topic->retained;
+    topic->retained = NULL;
+    up_write(&topic->sub_lock);
+
+    log_free(old, old_size);
+    if (retained) {
+        payload_put(retained);
+    }
+    return 0;
+}
+
+/*
+ * Aplica os campos de 'config' marcados em config->set. Topicos recem
+ * criados comecam com PUBSUB_POLICY_OVERWRITE.
+ */
+int topic_configure(topic_s *topic, const struct pubsub_topic_config *config)
+{
+    int policy, async;
+
+    if (config->set & ~PUBSUB_CONFIG_ALL) {
+        return -EINVAL;
+    }
+    if ((config->set & PUBSUB_CONFIG_POLICY) && config->policy > PUBSUB_POLICY_BLOCK) {
+        return -EINVAL;
+    }
+    if ((config->set & PUBSUB_CONFIG_ASYNC) && config->async > 1) {
+        return -EINVAL;
+    }
+    if ((config->set & PUBSUB_CONFIG_LOG) && config->log_entries > PUBSUB_LOG_MAX_ENTRIES) {
+        return -EINVAL;
+    }
+    if ((config->set & PUBSUB_CONFIG_RETAIN) && config->retain > 1) {
+        return -EINVAL;
+    }
+
+    /* BLOCK precisa de um publicador esperando; no modo assincrono nao ha */
+    policy = config->set & PUBSUB_CONFIG_POLICY ? config->policy : READ_ONCE(topic->policy);
+    async = config->set & PUBSUB_CONFIG_ASYNC ? config->async : READ_ONCE(topic->async);
+    if (async && policy == PUBSUB_POLICY_BLOCK) {
+        return -EINVAL;
+    }
+
+    /* Primeiro o que pode falhar por estado, para nao aplicar pela metade */
+    if (config->set & PUBSUB_CONFIG_LOG) {
+        int ret = topic_set_log(topic, config->log_entries);
+
+        if (ret) {
+            return ret;
+        }
+    }
+
+    if (config->set & PUBSUB_CONFIG_BLOCK_TIMEOUT) {
+        WRITE_ONCE(topic->block_timeout_ms, config->block_timeout_ms);
+    }
+    if (config->set & PUBSUB_CONFIG_POLICY) {
+        WRITE_ONCE(topic->policy, config->policy);
+        /* Quem esperava por espaco reavalia com a politica nova */
+        atomic_inc(&topic->space_seq);
+        wake_up_all(&topic->space_wait);
+    }
+    if (config->set & PUBSUB_CONFIG_ASYNC) {
+        WRITE_ONCE(topic->async, config->async);
+        if (!config->async) {
+            /* O que ja estava na fila sai antes das publicacoes sincronas */
+            flush_work(&topic->async_work);
+        }
+    }
+    if (config->set & PUBSUB_CONFIG_RETAIN) {
+        payload_s *retained = NULL;
+
+        down_write(&topic->sub_lock);
+        WRITE_ONCE(topic->retain, config->retain);
+        if (!config->retain) {
+            retained = topic->retained;
+            topic->retained = NULL;
+        }
+        up_write(&topic->sub_lock);
+        if (retained) {
+            payload_put(retained);
+        }
+    }
+    return 0;
+}
+
+int topic_publish_payload(topic_s *topic, payload_s *payload)
+{
+    int ret = topic_publish_payloads(topic, &payload, 1);
+
+    return ret < 0 ? ret : 0;
+}
+
+int topic_publish_message(topic_s *topic, const char *message_data, size_t size)
+{
+    payload_s *payload;
+    int ret;
+
+    // Uma unica copia do payload, compartilhada por todas as mailboxes
+    payload = payload_create(message_data, size);
+    if (!payload) {
+        printk(KERN_ERR "[PUBLISH] kmalloc failed for message data in topic '%s'.\n", topic ? topic->name : "(null)");
+        if (topic) {
+            this_cpu_inc(topic->stats->alloc_failed);
+        }
+        return -ENOMEM;
+    }
+
+    ret = topic_publish_payload(topic, payload);
+    payload_put(payload);
+    return ret;
+}
+
+/* Tempo que o payload passou na mailbox, medido ao ser consumido */
+void topic_record_dequeue(topic_s *topic, payload_s *payload)
+{
+    u64 now = ktime_get_ns();
+
+    this_cpu_inc(topic->stats->queue_latency[hist_bucket(now - payload->enqueue_ns)]);
+}
+
+/* Conta uma publicacao perdida por falta de memoria nos caminhos do driver */
+void topic_note_alloc_failure(topic_s *topic)
+{
+    this_cpu_inc(topic->stats->alloc_failed);
+}
+
+static void subscriber_unlinked(topic_s *topic, process_s *process)
+{
+    trace_pubsub_unsubscribe(topic->name, process->pid);
+
+    // Acorda leitores bloqueados para que vejam o fim da inscricao
+    WRITE_ONCE(process->removed, 1);
+    wake_up_interruptible_all(&process->wait);
+    wake_up_interruptible(&topic->poll_wait);
+    topic_space_freed(topic);
+
+    // A fila e liberada quando o ultimo leitor soltar a referencia
+    process_put(process);
+}
 
-    printk(KERN_INFO "--- Topics with Subscribers ---\n");
+/*
+ * Solta um registro obtido com topic_acquire_process(). Quando o ultimo
+ * dono sai, o processo deixa o topico: a caixa de um inscrito que morreu
+ * nao fica recebendo copias, e um PID reciclado nao herda a fila. Um
+ * registro ja removido por /unsubscribe so perde a referencia.
+ */
+void topic_release_process(topic_s *topic, char list_type, process_s *process)
+{
+    struct list_head *node = list_type == 's' ? &process->subscriber_node : &process->publish_node;
+    int unlinked = 0;
+
+    down_write(&topic->sub_lock);
+    if (process->owners > 0 && --process->owners == 0 && !list_empty(node)) {
+        list_del_init(node);
+        if (list_type == 's') {
+            topic->nr_subscribers--;
+        }
+        unlinked = 1;
+    }
+    up_write(&topic->sub_lock);
+
+    if (unlinked) {
+        if (list_type == 's') {
+            subscriber_unlinked(topic, process);
+        } else {
+            WRITE_ONCE(process->removed, 1);
+            process_put(process);
+        }
+    }
+    process_put(process);
+}
+
+void topic_remove_subscriber(topic_s *topic, int pid) {
+    process_s *process, *temp;
+
+    if (!topic) return;
+
+    down_write(&topic->sub_lock);
+    list_for_each_entry_safe(process, temp, &topic->process_subscribers, subscriber_node) {
+        if (process->pid == pid) {
+            list_del_init(&process->subscriber_node);
+            topic->nr_subscribers--;
+            up_write(&topic->sub_lock);
+            subscriber_unlinked(topic, process);
+            return;
+        }
+    }
+    up_write(&topic->sub_lock);
+    printk(KERN_WARNING "[REMOVE_SUB] Subscriber PID %d not found in topic '%s'.\n", pid, topic->name);
+}
+
+static const char *const topic_policy_name[] = { "overwrite", "drop", "block" };
+
+static void print_topic_details(struct seq_file *m, topic_s *topic)
+{
+    process_s *pub_entry;
+    process_s *sub_entry;
+    message_s *msg_entry;
+    int i;
+
+    seq_printf(m, "-> Topic: \"%s\" (handle %d, policy %s%s", topic->name, topic->id,
+               topic_policy_name[READ_ONCE(topic->policy)], READ_ONCE(topic->async) ? ", async" : "");
+    spin_lock(&topic->log_lock);
+    if (topic->log) {
+        seq_printf(m, ", log %u at %llu", topic->log_size, (unsigned long long)topic->log_head);
+    }
+    spin_unlock(&topic->log_lock);
+    if (READ_ONCE(topic->retain)) {
+        seq_puts(m, READ_ONCE(topic->retained) ? ", retained" : ", retain");
+    }
+    seq_puts(m, ")\n");
+
+    down_read(&topic->sub_lock);
+
+    seq_puts(m, "   - Publishers:");
+    if (list_empty(&topic->process_publishers)) {
+        seq_puts(m, " [None]\n");
+    } else {
+        seq_puts(m, "\n");
+        list_for_each_entry(pub_entry, &topic->process_publishers, publish_node) {
+            seq_printf(m, "     - PID: %d\n", pub_entry->pid);
+        }
+    }
+
+    seq_puts(m, "   - Subscribers:");
+    if (list_empty(&topic->process_subscribers)) {
+        seq_puts(m, " [None]\n");
+    } else {
+        seq_puts(m, "\n");
+        list_for_each_entry(sub_entry, &topic->process_subscribers, subscriber_node) {
+            spin_lock(&sub_entry->mailbox_lock);
+            seq_printf(m, "     - PID: %d (Mailbox Messages: %u)\n", sub_entry->pid, mailbox_pending(sub_entry));
+
+            for (i = 0; i < sub_entry->msg_count; i++) {
+                msg_entry = &sub_entry->ring[(sub_entry->head + i) % sub_entry->capacity];
+                seq_printf(m, "       - \"%.*s\"\n", (int)msg_entry->payload->size, msg_entry->payload->data);
+            }
+            spin_unlock(&sub_entry->mailbox_lock);
+        }
+    }
+    up_read(&topic->sub_lock);
+}
+
+/*
+ * Estado completo do broker, sob demanda (debugfs pubsub/state). Percorre
+ * todas as mensagens enfileiradas: nao e para o caminho quente.
+ */
+void show_topics(struct seq_file *m)
+{
+    topic_s *entry;
+
+    mutex_lock(&my_broker.lock);
+    seq_puts(m, "=============== BROKER STATE ===============\n");
+
+    seq_puts(m, "--- Topics with Subscribers ---\n");
     if (list_empty(&my_broker.subscriber)) {
-        printk(KERN_INFO "No topics found in subscriber list.\n");
+        seq_puts(m, "No topics found in subscriber list.\n");
     } else {
         list_for_each_entry(entry, &my_broker.subscriber, subscribe_node) {
-            print_topic_details(entry);
+            print_topic_details(m, entry);
         }
     }
 
-    printk(KERN_INFO "\n--- Topics with Publishers ---\n");
+    seq_puts(m, "\n--- Topics with Publishers ---\n");
     if (list_empty(&my_broker.publish)) {
-        printk(KERN_INFO "No topics found in publish list.\n");
+        seq_puts(m, "No topics found in publish list.\n");
     } else {
         list_for_each_entry(entry, &my_broker.publish, publish_node) {
-            print_topic_details(entry);
+            print_topic_details(m, entry);
+        }
+    }
+    seq_puts(m, "==========================================\n");
+    mutex_unlock(&my_broker.lock);
+}
+
+static void topic_stats_sum(topic_s *topic, topic_stats_s *sum)
+{
+    topic_stats_s *cpu_stats;
+    int cpu, i;
+
+    memset(sum, 0, sizeof(*sum));
+    for_each_possible_cpu(cpu) {
+        cpu_stats = per_cpu_ptr(topic->stats, cpu);
+        sum->published += cpu_stats->published;
+        sum->delivered += cpu_stats->delivered;
+        sum->overwritten += cpu_stats->overwritten;
+        sum->dropped += cpu_stats->dropped;
+        sum->alloc_failed += cpu_stats->alloc_failed;
+        sum->evicted += cpu_stats->evicted;
+        sum->bytes += cpu_stats->bytes;
+        for (i = 0; i < BROKER_HIST_BUCKETS; i++) {
+            sum->queue_latency[i] += cpu_stats->queue_latency[i];
+            sum->fanout_latency[i] += cpu_stats->fanout_latency[i];
+        }
+    }
+}
+
+/*
+ * Contadores de todos os topicos e inscricoes (debugfs pubsub/stats).
+ * As somas por CPU nao sao um retrato atomico, mas cada contador so cresce.
+ */
+void show_stats(struct seq_file *m)
+{
+    topic_s *topic;
+    process_s *sub;
+    topic_stats_s *sum;
+    int id;
+
+    /* Com os histogramas a soma passa de 500 bytes: fora da pilha */
+    sum = kmalloc(sizeof(*sum), GFP_KERNEL);
+    if (!sum) {
+        return;
+    }
+
+    seq_printf(m, "memory payload_bytes %lld budget %lu queued_msgs %lld ring_bytes %lld\n",
+               percpu_counter_sum_positive(&payload_bytes), READ_ONCE(max_queued_bytes),
+               percpu_counter_sum_positive(&queued_msgs), percpu_counter_sum_positive(&ring_bytes));
+
+    mutex_lock(&my_broker.lock);
+    idr_for_each_entry(&my_broker.topic_ids, topic, id) {
+        topic_stats_sum(topic, sum);
+        seq_printf(m, "topic %s handle %d published %llu delivered %llu overwritten %llu dropped %llu alloc_failed %llu evicted %llu bytes %llu\n",
+                   topic->name, topic->id, sum->published, sum->delivered, sum->overwritten,
+                   sum->dropped, sum->alloc_failed, sum->evicted, sum->bytes);
+
+        down_read(&topic->sub_lock);
+        list_for_each_entry(sub, &topic->process_subscribers, subscriber_node) {
+            spin_lock(&sub->mailbox_lock);
+            seq_printf(m, "  sub %d delivered %llu overwritten %llu dropped %llu evicted %llu depth %u max_depth %u\n",
+                       sub->pid, sub->delivered, sub->overwritten, sub->dropped, sub->evicted,
+                       mailbox_pending(sub), sub->max_depth);
+            spin_unlock(&sub->mailbox_lock);
+        }
+        up_read(&topic->sub_lock);
+    }
+    mutex_unlock(&my_broker.lock);
+
+    kfree(sum);
+}
+
+/*
+ * Limite superior (ns) do bucket onde cai o percentil 'pct'; 0 sem amostras.
+ */
+static u64 hist_percentile(const u64 *hist, unsigned int pct)
+{
+    u64 total = 0, seen = 0, target;
+    int i;
+
+    for (i = 0; i < BROKER_HIST_BUCKETS; i++) {
+        total += hist[i];
+    }
+    if (total == 0) {
+        return 0;
+    }
+
+    target = div_u64(total * pct + 99, 100);
+    for (i = 0; i < BROKER_HIST_BUCKETS; i++) {
+        seen += hist[i];
+        if (seen >= target) {
+            break;
+        }
+    }
+    return 2ULL << min(i, BROKER_HIST_BUCKETS - 1);
+}
+
+static void print_histogram(struct seq_file *m, const char *label, const u64 *hist)
+{
+    int i;
+
+    seq_printf(m, "  %s p50<=%lluns p99<=%lluns\n", label,
+               hist_percentile(hist, 50), hist_percentile(hist, 99));
+    for (i = 0; i < BROKER_HIST_BUCKETS; i++) {
+        if (hist[i]) {
+            seq_printf(m, "    [%llu, %llu) %llu\n", i ? 1ULL << i : 0ULL, 2ULL << i, hist[i]);
+        }
+    }
+}
+
+/*
+ * Histogramas de latencia por topico (debugfs pubsub/latency): tempo na
+ * mailbox ate o read() e custo de cada publicacao. Leituras pelo anel
+ * mmap nao passam pelo kernel e nao entram no primeiro.
+ */
+void show_latency(struct seq_file *m)
+{
+    topic_s *topic;
+    topic_stats_s *sum;
+    int id;
+
+    sum = kmalloc(sizeof(*sum), GFP_KERNEL);
+    if (!sum) {
+        return;
+    }
+
+    mutex_lock(&my_broker.lock);
+    idr_for_each_entry(&my_broker.topic_ids, topic, id) {
+        topic_stats_sum(topic, sum);
+        seq_printf(m, "topic %s\n", topic->name);
+        print_histogram(m, "queue", sum->queue_latency);
+        print_histogram(m, "fanout", sum->fanout_latency);
+    }
+    mutex_unlock(&my_broker.lock);
+
+    kfree(sum);
+}
+
+/*
+ * Shrinker: sob pressao de memoria, descarta as mensagens mais antigas das
+ * mailboxes (ate metade de cada uma por passada, para espalhar a perda).
+ * Alocacoes do broker acontecem com my_broker.lock e sub_lock, entao aqui
+ * so se usa trylock. Aneis mmap sao do consumidor e ficam de fora.
+ *
+ * As contas sao em paginas de payload: um payload e compartilhado por
+ * varias mailboxes e so volta ao sistema com a ultima referencia, entao
+ * tirar uma entrada pode nao liberar nada. count parte do orcamento
+ * (payload_bytes sem os aneis mmap) e scan so conta os payloads que de
+ * fato liberou; sem nada a liberar, scan para na primeira passada vazia.
+ */
+static unsigned long broker_shrink_count(struct shrinker *shrink, struct shrink_control *sc)
+{
+    s64 bytes = percpu_counter_read(&payload_bytes) - percpu_counter_read(&ring_bytes);
+
+    return bytes > 0 ? bytes >> PAGE_SHIFT : 0;
+}
+
+static unsigned long broker_shrink_scan(struct shrinker *shrink, struct shrink_control *sc)
+{
+    topic_s *topic;
+    process_s *sub;
+    payload_s *victim;
+    unsigned long target = sc->nr_to_scan << PAGE_SHIFT;
+    unsigned long freed = 0, evicted, topic_evicted, quota;
+    s64 charge;
+    int id;
+
+    if (!mutex_trylock(&my_broker.lock)) {
+        return SHRINK_STOP;
+    }
+
+    /* 'freed' em bytes; uma passada sem nada removido encerra */
+    do {
+        evicted = 0;
+        idr_for_each_entry(&my_broker.topic_ids, topic, id) {
+            if (!down_read_trylock(&topic->sub_lock)) {
+                continue;
+            }
+            topic_evicted = 0;
+            list_for_each_entry(sub, &topic->process_subscribers, subscriber_node) {
+                quota = DIV_ROUND_UP(READ_ONCE(sub->msg_count), 2);
+                while (quota-- > 0 && freed < target) {
+                    spin_lock(&sub->mailbox_lock);
+                    victim = __mailbox_pop(sub);
+                    if (victim) {
+                        sub->evicted++;
+                    }
+                    spin_unlock(&sub->mailbox_lock);
+                    if (!victim) {
+                        break;
+                    }
+                    charge = payload_charge(victim);
+                    if (kref_put(&victim->ref, payload_release)) {
+                        freed += charge;
+                    }
+                    this_cpu_inc(topic->stats->evicted);
+                    topic_evicted++;
+                }
+            }
+            up_read(&topic->sub_lock);
+            if (topic_evicted) {
+                topic_space_freed(topic);
+            }
+            evicted += topic_evicted;
+        }
+    } while (evicted && freed < target);
+
+    mutex_unlock(&my_broker.lock);
+    return freed >> PAGE_SHIFT;
+}
+
+/*
+ * Libera topicos, registros e as mensagens ainda enfileiradas. Como
+ * fops.owner segura o modulo, nao ha fd aberto aqui: cada processo tem so
+ * a referencia da lista e process_put() o libera com a caixa.
+ */
+void broker_exit(void)
+{
+    topic_s *topic;
+    process_s *process, *next;
+    int id;
+
+    if (shrinker_registered) {
+        unregister_shrinker(&broker_shrinker);
+        shrinker_registered = false;
+    }
+
+    /* Entrega os lotes assincronos pendentes antes de soltar os topicos */
+    broker_destroy_workqueues();
+
+    idr_for_each_entry(&my_broker.topic_ids, topic, id) {
+        list_for_each_entry_safe(process, next, &topic->process_subscribers, subscriber_node) {
+            list_del(&process->subscriber_node);
+            process_put(process);
+        }
+        list_for_each_entry_safe(process, next, &topic->process_publishers, publish_node) {
+            list_del(&process->publish_node);
+            process_put(process);
         }
+        list_del(&topic->publish_node);
+        list_del(&topic->subscribe_node);
+        topic_free(topic);
     }
-    printk(KERN_INFO "==========================================\n");
-}
\ No newline at end of file
+
+    trie_free(&my_broker.filters);
+    idr_destroy(&my_broker.topic_ids);
+    kvfree(rcu_dereference_protected(my_broker.topic_table, 1));
+    my_broker.topic_table = NULL;
+    my_broker.nr_topics = 0;
+    percpu_counter_destroy(&ring_bytes);
+    percpu_counter_destroy(&queued_msgs);
+    percpu_counter_destroy(&payload_bytes);
+    broker_destroy_caches();
+    printk(KERN_INFO "[BROKER_EXIT] Broker released.\n");
+}
@@ -3,53 +3,232 @@
 
 #include <linux/list.h>
 #include <linux/slab.h>
+#include <linux/hashtable.h>
+#include <linux/kref.h>
+#include <linux/mutex.h>
+#include <linux/rwsem.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/percpu.h>
+#include <linux/idr.h>
+#include <linux/workqueue.h>
+
+#include "pubsub_uapi.h"
+
+#define BROKER_HASH_BITS 12         /* tamanho inicial padrao da tabela de topicos */
+#define BROKER_HASH_MAX_BITS 20
+#define DEFAULT_MAX_MSG_N 16
+#define DEFAULT_MAX_MSG_SIZE (64 * 1024)
+#define MAX_MSG_SIZE_LIMIT (16 * 1024 * 1024)
+#define DEFAULT_BLOCK_TIMEOUT_MS 1000
+#define DEFAULT_MAX_QUEUED_BYTES (256UL * 1024 * 1024)
+#define DEFAULT_MMAP_SLOT_PAYLOAD 256
+#define MMAP_SLOT_PAYLOAD_MAX (64 * 1024)   /* maior mensagem que cabe num slot mmap */
+/* Histogramas em escala log2 de nanossegundos: bucket i cobre [2^i, 2^(i+1)) */
+#define BROKER_HIST_BUCKETS 32
 
 extern int max_msg_size; 
 extern int max_msg_n;
+extern unsigned long max_queued_bytes;
+extern int topic_hash_bits;
 
 typedef struct {
-    char *message;
+    struct kref ref;
+    u64 enqueue_ns;     /* ktime_get_ns() na publicacao */
     size_t size;
-    struct list_head link;
+    char data[];
+} payload_s;
+
+typedef struct {
+    payload_s *payload;
 } message_s;
 
+/*
+ * Mailbox mapeada em espaco de usuario. O cabecalho compartilhado pode ser
+ * alterado pelo consumidor, entao o kernel guarda suas proprias copias de
+ * head e da geometria e so confia no tail vindo de 'shared'.
+ */
 typedef struct {
+    struct pubsub_mmap_ring *shared;
+    size_t size;
+    u32 head;
+    u32 slot_count;
+    u32 slot_size;
+} mmap_ring_s;
+
+typedef struct {
+    struct kref ref;
+    spinlock_t mailbox_lock;
+    wait_queue_head_t wait;
+    int removed;
     int pid;
+    unsigned int owners;            /* fds que criaram o registro, sob sub_lock */
     int msg_count;                  
-    struct list_head message_queue;   
+    unsigned int head;                
+    unsigned int tail;                
+    unsigned int capacity;            
+    message_s *ring;                  
+    mmap_ring_s *mmap;
+    struct topic *topic;            /* topico em que o processo se registrou */
+    /* Estatisticas da inscricao, sob mailbox_lock */
+    u64 delivered;
+    u64 overwritten;
+    u64 dropped;
+    unsigned int max_depth;
+    u64 evicted;                    /* descartadas pelo shrinker */
+    u64 log_pos;                    /* modo log: proxima sequencia, sob topic->log_lock */
     struct list_head publish_node;    
     struct list_head subscriber_node; 
 } process_s;
 
+/*
+ * Contadores por topico, um conjunto por CPU: publicadores em CPUs
+ * diferentes nao disputam a mesma linha de cache. A leitura soma todas.
+ */
+typedef struct {
+    u64 published;      /* mensagens aceitas pelo topico */
+    u64 delivered;      /* copias entregues as mailboxes */
+    u64 overwritten;    /* mensagens antigas sobrescritas (mailbox cheia) */
+    u64 dropped;        /* descartadas pelo anel mmap cheio ou no fan-out assincrono */
+    u64 alloc_failed;   /* perdidas por falta de memoria ou de orcamento */
+    u64 evicted;        /* descartadas pelo shrinker */
+    u64 bytes;          /* bytes publicados */
+    u64 queue_latency[BROKER_HIST_BUCKETS];    /* publicacao -> read() */
+    u64 fanout_latency[BROKER_HIST_BUCKETS];   /* duracao da entrega a todos os inscritos */
+} topic_stats_s;
+
 
 typedef struct topic {
     char *name;
+    unsigned int hash;
+    int id;             /* handle numerico devolvido ao usuario */
+    int is_filter;      /* nome com '+'/'#': so recebe via trie */
     int msg_count;
+
+    struct hlist_node hash_node[2];     /* ver topic_table_s */
     
     struct list_head publish_node;        
     struct list_head subscribe_node;      
     
+    struct rw_semaphore sub_lock;
+    wait_queue_head_t poll_wait;
     struct list_head process_subscribers; 
     struct list_head process_publishers;  
+    unsigned int nr_subscribers;        /* sob sub_lock */
+
+    /* Politica de mailbox cheia (PUBSUB_POLICY_*), ver topic_configure() */
+    int policy;
+    unsigned int block_timeout_ms;
+    unsigned long block_busy;           /* TOPIC_BLOCK_BUSY, ver targets_claim() */
+    wait_queue_head_t space_wait;       /* publicadores esperando espaco */
+    atomic_t space_seq;                 /* muda quando abre espaco */
+
+    /* Modo assincrono: publicacoes esperando a workqueue de fan-out */
+    int async;
+    spinlock_t async_lock;
+    struct list_head async_queue;
+    struct work_struct async_work;
+    unsigned long async_queued;         /* sequencia do ultimo lote enfileirado, sob async_lock */
+    unsigned long async_done;           /* sequencia do ultimo lote entregue */
+    wait_queue_head_t async_wait;       /* topic_flush() */
+
+    /*
+     * Modo log: um anel de payloads compartilhado por todos os inscritos,
+     * que guardam so a posicao (process->log_pos). log_head e a sequencia
+     * da proxima mensagem; ficam as ultimas log_size.
+     */
+    spinlock_t log_lock;
+    payload_s **log;                    /* NULL fora do modo log */
+    unsigned int log_size;              /* potencia de 2 */
+    u64 log_head;
+
+    /*
+     * Ultima mensagem publicada, entregue a cada inscrito novo. Trocada
+     * com sub_lock para leitura (xchg) e lida com ele para escrita. Em
+     * modo log nao e usada: o inscrito novo comeca na ultima do log.
+     */
+    int retain;
+    payload_s *retained;
+
+    topic_stats_s __percpu *stats;
 } topic_s;
 
+/*
+ * No da trie de filtros com curingas, um por segmento do caminho
+ * ("a/+/c" -> "a", "+", "c"). 'filter' e o topico do filtro que termina
+ * neste no, se houver.
+ */
+typedef struct topic_node {
+    char *segment;
+    topic_s *filter;
+    struct list_head children;
+    struct list_head sibling;
+} topic_node_s;
+
+/*
+ * Tabela hash de topicos. Dobra quando passa de um topico por bucket;
+ * como topicos so saem em broker_exit(), cada um tem dois nos e a tabela
+ * nova e montada pelo outro, sem tirar nada da que os leitores RCU ainda
+ * percorrem.
+ */
+typedef struct {
+    unsigned int bits;
+    unsigned int slot;                  /* qual topic_s.hash_node encadeia aqui */
+    struct hlist_head buckets[];
+} topic_table_s;
+
 typedef struct {
+    topic_table_s __rcu *topic_table;
+    unsigned int nr_topics;             /* sob lock */
+    topic_node_s filters;       /* raiz da trie de filtros */
+    struct idr topic_ids;       /* handle -> topico */
+    struct mutex lock;
     struct list_head subscriber; 
     struct list_head publish;   
     int max_msg;
 } broker_s;
 
-void broker_init(void);
+int broker_init(void);
+void broker_exit(void);
 topic_s *create_topic(const char *name);
 process_s *create_process(int pid);
 topic_s *find_topic(const char *name);
-process_s *find_process(int pid);
-void insert_topic_to_broker(topic_s *topic, char list_type);
+topic_s *find_or_create_topic(const char *topic_name);
+topic_s *find_topic_by_handle(u32 handle);
+process_s *topic_get_subscriber(topic_s *topic, int pid);
+void process_get(process_s *process);
+void process_put(process_s *process);
 int is_pid_in_subscribers(int pid, topic_s *topic);
 int is_pid_in_publishers(int pid, topic_s *topic);
-int register_process_to_topic(const char *topic_name, char list_type, int pid);
-int topic_publish_message(topic_s *topic, const char *message_data, short max_size);
+int register_process_to_topic(const char *topic_name, char list_type, int pid, topic_s **topic_out);
+int topic_register_process(topic_s *topic, char list_type, int pid);
+process_s *topic_acquire_process(topic_s *topic, char list_type, int pid);
+void topic_release_process(topic_s *topic, char list_type, process_s *process);
+payload_s *payload_alloc(size_t size);
+payload_s *payload_create(const char *data, size_t size);
+void payload_get(payload_s *payload);
+void payload_put(payload_s *payload);
+int process_alloc_mailbox(process_s *process, unsigned int capacity);
+payload_s *mailbox_pop(process_s *process);
+payload_s *mailbox_pop_if_fits(process_s *process, size_t room, size_t *needed);
+size_t mailbox_next_size(process_s *process);
+wait_queue_head_t *mailbox_waitq(process_s *process);
+loff_t topic_log_seek(process_s *process, loff_t offset, int whence);
+int topic_log_status(process_s *process, struct pubsub_log_status *status);
+int mailbox_readable(process_s *process);
+unsigned int mailbox_pending(process_s *process);
+int process_attach_mmap_ring(process_s *process);
+int topic_publish_payloads(topic_s *topic, payload_s **payloads, unsigned int count);
+int topic_publish_payload(topic_s *topic, payload_s *payload);
+int topic_publish_message(topic_s *topic, const char *message_data, size_t size);
+void topic_note_alloc_failure(topic_s *topic);
+int topic_configure(topic_s *topic, const struct pubsub_topic_config *config);
+int topic_flush(topic_s *topic);
+void topic_record_dequeue(topic_s *topic, payload_s *payload);
 void topic_remove_subscriber(topic_s *topic, int pid);
-void show_topics(void);
+struct seq_file;
+void show_topics(struct seq_file *m);
+void show_stats(struct seq_file *m);
+void show_latency(struct seq_file *m);
 
 #endif
\ No newline at end of file
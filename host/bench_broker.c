@@ -0,0 +1,205 @@
+/*
+ * Microbenchmark do broker.c em userspace (make host-bench). Mede
+ * find_topic, register_process_to_topic e topic_publish_message com 10 a
+ * 100k topicos e 1 a 10k inscritos, com mailboxes e em modo log, uma linha chave=valor por medida, para
+ * comparar versoes antes de carregar o modulo.
+ *
+ *   ./host/bench_broker [-q] [-n operacoes]
+ *
+ * -q limita a 10k topicos e 1k inscritos.
+ */
+#include <getopt.h>
+
+#include "host_kernel.h"
+#include "broker.h"
+
+/* Parametros do modulo, definidos em main_driver.c no kernel */
+int max_msg_size = DEFAULT_MAX_MSG_SIZE;
+int max_msg_n = DEFAULT_MAX_MSG_N;
+unsigned long max_queued_bytes = DEFAULT_MAX_QUEUED_BYTES;
+int topic_hash_bits = BROKER_HASH_BITS;
+
+#define BENCH_NAME_MAX      64
+#define BENCH_PAYLOAD_SIZE  64
+#define BENCH_FIRST_PID     1000
+/* Limita o total de copias por medida de publish */
+#define BENCH_MAX_DELIVERIES 4000000UL
+
+static const int topic_counts[] = { 10, 100, 1000, 10000, 100000 };
+static const int subscriber_counts[] = { 1, 10, 100, 1000, 10000 };
+
+static unsigned long ops = 1000000;
+static int quick;
+
+static u64 now_ns(void)
+{
+    return ktime_get_ns();
+}
+
+static void report(const char *bench, const char *key, int value, unsigned long n, u64 elapsed)
+{
+    printf("bench=%s %s=%d ops=%lu ns_per_op=%.1f\n", bench, key, value, n, (double)elapsed / n);
+}
+
+static void broker_start(void)
+{
+    if (broker_init()) {
+        fprintf(stderr, "broker_init failed\n");
+        exit(1);
+    }
+}
+
+static void bench_find_topic(int topics)
+{
+    char (*names)[BENCH_NAME_MAX];
+    unsigned long i, misses = 0;
+    u32 seed = 12345;
+    u64 start;
+    int t;
+
+    names = malloc(topics * sizeof(*names));
+    if (!names) {
+        exit(1);
+    }
+
+    broker_start();
+    for (t = 0; t < topics; t++) {
+        snprintf(names[t], BENCH_NAME_MAX, "bench/topic/%d", t);
+        if (IS_ERR(find_or_create_topic(names[t]))) {
+            fprintf(stderr, "find_or_create_topic(%s) failed\n", names[t]);
+            exit(1);
+        }
+    }
+
+    start = now_ns();
+    for (i = 0; i < ops; i++) {
+        /* LCG: acessos espalhados, sem favorecer o cache */
+        seed = seed * 1664525u + 1013904223u;
+        if (!find_topic(names[seed % topics])) {
+            misses++;
+        }
+    }
+    report("find_topic", "topics", topics, ops, now_ns() - start);
+    if (misses) {
+        fprintf(stderr, "find_topic: %lu misses\n", misses);
+    }
+
+    broker_exit();
+    free(names);
+}
+
+static void bench_register(int subscribers)
+{
+    topic_s *topic;
+    u64 start;
+    unsigned long i;
+    int s;
+
+    broker_start();
+
+    /* Primeiro registro de cada PID: cria o processo e a caixa */
+    start = now_ns();
+    for (s = 0; s < subscribers; s++) {
+        if (register_process_to_topic("bench/register", 's', BENCH_FIRST_PID + s, &topic)) {
+            fprintf(stderr, "register_process_to_topic failed\n");
+            exit(1);
+        }
+    }
+    report("register_new", "subscribers", subscribers, subscribers, now_ns() - start);
+
+    /* Registro repetido, como todo /publish de texto: so a busca na lista */
+    start = now_ns();
+    for (i = 0; i < ops; i++) {
+        register_process_to_topic("bench/register", 's', BENCH_FIRST_PID + subscribers - 1, NULL);
+    }
+    report("register_again", "subscribers", subscribers, ops, now_ns() - start);
+
+    broker_exit();
+}
+
+static void bench_publish(int subscribers, int log)
+{
+    struct pubsub_topic_config config = { .set = PUBSUB_CONFIG_LOG, .log_entries = DEFAULT_MAX_MSG_N };
+    const char *bench = log ? "publish_log" : "publish";
+    char payload[BENCH_PAYLOAD_SIZE];
+    unsigned long i, n;
+    topic_s *topic = NULL;
+    u64 start, elapsed;
+    int s;
+
+    broker_start();
+    if (log && topic_configure(find_or_create_topic("bench/publish"), &config)) {
+        fprintf(stderr, "topic_configure(log) failed\n");
+        exit(1);
+    }
+    for (s = 0; s < subscribers; s++) {
+        register_process_to_topic("bench/publish", 's', BENCH_FIRST_PID + s, &topic);
+    }
+    memset(payload, 'x', sizeof(payload));
+
+    n = min_t(unsigned long, ops, max_t(unsigned long, BENCH_MAX_DELIVERIES / subscribers, 1000));
+
+    /* As caixas enchem logo; a medida e o regime de sobrescrita */
+    start = now_ns();
+    for (i = 0; i < n; i++) {
+        topic_publish_message(topic, payload, sizeof(payload));
+    }
+    elapsed = now_ns() - start;
+    report(bench, "subscribers", subscribers, n, elapsed);
+    printf("bench=%s_per_delivery subscribers=%d ops=%lu ns_per_op=%.2f\n",
+           bench, subscribers, n * subscribers, (double)elapsed / (n * subscribers));
+
+    broker_exit();
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int i;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "qn:v")) != -1) {
+        switch (opt) {
+        case 'q':
+            quick = 1;
+            break;
+        case 'n':
+            ops = strtoul(optarg, NULL, 10);
+            break;
+        case 'v':
+            host_printk_enabled = 1;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-q] [-n ops] [-v]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (ops == 0) {
+        ops = 1;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(topic_counts); i++) {
+        if (quick && topic_counts[i] > 10000) {
+            break;
+        }
+        bench_find_topic(topic_counts[i]);
+    }
+    for (i = 0; i < ARRAY_SIZE(subscriber_counts); i++) {
+        if (quick && subscriber_counts[i] > 1000) {
+            break;
+        }
+        bench_register(subscriber_counts[i]);
+    }
+    for (i = 0; i < ARRAY_SIZE(subscriber_counts); i++) {
+        if (quick && subscriber_counts[i] > 1000) {
+            break;
+        }
+        bench_publish(subscriber_counts[i], 0);
+    }
+    for (i = 0; i < ARRAY_SIZE(subscriber_counts); i++) {
+        if (quick && subscriber_counts[i] > 1000) {
+            break;
+        }
+        bench_publish(subscriber_counts[i], 1);
+    }
+    return 0;
+}
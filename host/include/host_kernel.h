@@ -0,0 +1,656 @@
+#ifndef HOST_KERNEL_H
+#define HOST_KERNEL_H
+
+/*
+ * Shim da API do kernel para compilar broker.c em userspace (make
+ * host-bench, make host-test).
+ * Cobre so o que o broker usa: listas, tabelas hash, slab, locks, kref,
+ * percpu, idr, workqueues, seq_file e tracepoints. Locks viram pthreads,
+ * RCU e tracepoints somem, "percpu" tem uma unica CPU, workqueues rodam o
+ * work na hora e GFP/SLAB sao ignorados.
+ * Nao serve para validar concorrencia, so logica e custo de CPU.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <linux/types.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef unsigned long long u64;   /* como no kernel: %llu em toda arquitetura */
+typedef int32_t s32;
+typedef long long s64;
+typedef unsigned int gfp_t;
+typedef s64 ktime_t;
+
+/* ==================== compilador ==================== */
+
+#define __user
+#define __percpu
+#define __rcu
+#define __init
+#define __exit
+#define __must_check
+
+#define likely(x)       __builtin_expect(!!(x), 1)
+#define unlikely(x)     __builtin_expect(!!(x), 0)
+
+#define READ_ONCE(x)            (*(volatile __typeof__(x) *)&(x))
+#define WRITE_ONCE(x, v)        (*(volatile __typeof__(x) *)&(x) = (v))
+#define smp_load_acquire(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define smp_store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define smp_wmb()               __atomic_thread_fence(__ATOMIC_RELEASE)
+#define smp_rmb()               __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define smp_mb()                __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+static inline int test_bit(int nr, const unsigned long *addr)
+{
+    return (__atomic_load_n(addr, __ATOMIC_RELAXED) >> nr) & 1;
+}
+static inline int test_and_set_bit_lock(int nr, unsigned long *addr)
+{
+    return (__atomic_fetch_or(addr, 1UL << nr, __ATOMIC_ACQUIRE) >> nr) & 1;
+}
+static inline void clear_bit_unlock(int nr, unsigned long *addr)
+{
+    __atomic_fetch_and(addr, ~(1UL << nr), __ATOMIC_RELEASE);
+}
+
+#define container_of(ptr, type, member) \
+    ((type *)((char *)(ptr) - offsetof(type, member)))
+
+#define ARRAY_SIZE(a)           (sizeof(a) / sizeof((a)[0]))
+#define DIV_ROUND_UP(n, d)      (((n) + (d) - 1) / (d))
+#define ALIGN(x, a)             (((x) + (a) - 1) & ~((__typeof__(x))(a) - 1))
+#define min(a, b)               ((a) < (b) ? (a) : (b))
+#define max(a, b)               ((a) > (b) ? (a) : (b))
+#define min3(a, b, c)           min(min(a, b), c)
+#define min_t(t, a, b)          ((t)(a) < (t)(b) ? (t)(a) : (t)(b))
+#define max_t(t, a, b)          ((t)(a) > (t)(b) ? (t)(a) : (t)(b))
+#define clamp_t(t, v, lo, hi)   min_t(t, max_t(t, v, lo), hi)
+#define BUILD_BUG_ON(c)         ((void)sizeof(char[1 - 2 * !!(c)]))
+#define WARN_ON(c)              (!!(c))
+#define WARN_ON_ONCE(c)         (!!(c))
+
+#ifndef U32_MAX
+#define U32_MAX                 ((u32)~0U)
+#endif
+
+#define ERESTARTSYS             512
+#define MAX_ERRNO               4095
+#define IS_ERR_VALUE(x)         ((unsigned long)(x) >= (unsigned long)-MAX_ERRNO)
+
+static inline void *ERR_PTR(long error) { return (void *)error; }
+static inline long PTR_ERR(const void *ptr) { return (long)ptr; }
+static inline bool IS_ERR(const void *ptr) { return IS_ERR_VALUE(ptr); }
+
+/* ==================== printk ==================== */
+
+#define KERN_EMERG      ""
+#define KERN_ALERT      ""
+#define KERN_ERR        ""
+#define KERN_WARNING    ""
+#define KERN_NOTICE     ""
+#define KERN_INFO       ""
+#define KERN_DEBUG      ""
+#define KERN_CONT       ""
+
+/* Desligado por padrao: o broker avisa em caminhos que o benchmark repete */
+extern int host_printk_enabled;
+int printk(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+/* ==================== atomic e kref ==================== */
+
+typedef struct {
+    int counter;
+} atomic_t;
+
+#define ATOMIC_INIT(i)  { (i) }
+#define xchg(ptr, v)    __atomic_exchange_n((ptr), (v), __ATOMIC_SEQ_CST)
+
+static inline int atomic_read(const atomic_t *v) { return __atomic_load_n(&v->counter, __ATOMIC_RELAXED); }
+static inline void atomic_set(atomic_t *v, int i) { __atomic_store_n(&v->counter, i, __ATOMIC_RELAXED); }
+static inline void atomic_add(int i, atomic_t *v) { __atomic_add_fetch(&v->counter, i, __ATOMIC_RELAXED); }
+static inline void atomic_inc(atomic_t *v) { atomic_add(1, v); }
+static inline void atomic_dec(atomic_t *v) { atomic_add(-1, v); }
+static inline int atomic_inc_return(atomic_t *v) { return __atomic_add_fetch(&v->counter, 1, __ATOMIC_SEQ_CST); }
+static inline bool atomic_dec_and_test(atomic_t *v) { return __atomic_sub_fetch(&v->counter, 1, __ATOMIC_SEQ_CST) == 0; }
+
+struct kref {
+    atomic_t refcount;
+};
+
+static inline void kref_init(struct kref *kref) { atomic_set(&kref->refcount, 1); }
+static inline void kref_get(struct kref *kref) { atomic_inc(&kref->refcount); }
+
+static inline int kref_put(struct kref *kref, void (*release)(struct kref *kref))
+{
+    if (atomic_dec_and_test(&kref->refcount)) {
+        release(kref);
+        return 1;
+    }
+    return 0;
+}
+
+/* ==================== listas ==================== */
+
+struct list_head {
+    struct list_head *next, *prev;
+};
+
+struct hlist_head {
+    struct hlist_node *first;
+};
+
+struct hlist_node {
+    struct hlist_node *next, **pprev;
+};
+
+#define LIST_HEAD_INIT(name)    { &(name), &(name) }
+#define LIST_HEAD(name)         struct list_head name = LIST_HEAD_INIT(name)
+
+static inline void INIT_LIST_HEAD(struct list_head *list)
+{
+    list->next = list;
+    list->prev = list;
+}
+
+static inline void __list_add(struct list_head *new, struct list_head *prev, struct list_head *next)
+{
+    next->prev = new;
+    new->next = next;
+    new->prev = prev;
+    prev->next = new;
+}
+
+static inline void list_add(struct list_head *new, struct list_head *head) { __list_add(new, head, head->next); }
+static inline void list_add_tail(struct list_head *new, struct list_head *head) { __list_add(new, head->prev, head); }
+
+static inline void list_del(struct list_head *entry)
+{
+    entry->next->prev = entry->prev;
+    entry->prev->next = entry->next;
+    entry->next = NULL;
+    entry->prev = NULL;
+}
+
+static inline void list_del_init(struct list_head *entry)
+{
+    entry->next->prev = entry->prev;
+    entry->prev->next = entry->next;
+    INIT_LIST_HEAD(entry);
+}
+
+static inline int list_empty(const struct list_head *head) { return READ_ONCE(head->next) == head; }
+
+static inline void list_splice_init(struct list_head *list, struct list_head *head)
+{
+    if (!list_empty(list)) {
+        struct list_head *first = list->next, *last = list->prev, *at = head->next;
+
+        first->prev = head;
+        head->next = first;
+        last->next = at;
+        at->prev = last;
+        INIT_LIST_HEAD(list);
+    }
+}
+
+#define list_entry(ptr, type, member)       container_of(ptr, type, member)
+#define list_first_entry(ptr, type, member) list_entry((ptr)->next, type, member)
+#define list_next_entry(pos, member)        list_entry((pos)->member.next, __typeof__(*(pos)), member)
+
+#define list_for_each_entry(pos, head, member)                          \
+    for (pos = list_first_entry(head, __typeof__(*pos), member);        \
+         &pos->member != (head);                                        \
+         pos = list_next_entry(pos, member))
+
+#define list_for_each_entry_from(pos, head, member)                     \
+    for (; &pos->member != (head); pos = list_next_entry(pos, member))
+
+#define list_for_each_entry_safe(pos, n, head, member)                  \
+    for (pos = list_first_entry(head, __typeof__(*pos), member),        \
+         n = list_next_entry(pos, member);                              \
+         &pos->member != (head);                                        \
+         pos = n, n = list_next_entry(n, member))
+
+#define INIT_HLIST_HEAD(ptr)    ((ptr)->first = NULL)
+
+static inline void INIT_HLIST_NODE(struct hlist_node *h)
+{
+    h->next = NULL;
+    h->pprev = NULL;
+}
+
+static inline void hlist_add_head(struct hlist_node *n, struct hlist_head *h)
+{
+    struct hlist_node *first = h->first;
+
+    n->next = first;
+    if (first) {
+        first->pprev = &n->next;
+    }
+    h->first = n;
+    n->pprev = &h->first;
+}
+
+static inline void hlist_del_init(struct hlist_node *n)
+{
+    if (n->pprev) {
+        *n->pprev = n->next;
+        if (n->next) {
+            n->next->pprev = n->pprev;
+        }
+        INIT_HLIST_NODE(n);
+    }
+}
+
+#define hlist_entry(ptr, type, member) container_of(ptr, type, member)
+#define hlist_entry_safe(ptr, type, member) \
+    ({ __typeof__(ptr) ____ptr = (ptr); ____ptr ? hlist_entry(____ptr, type, member) : NULL; })
+
+#define hlist_for_each_entry(pos, head, member)                                 \
+    for (pos = hlist_entry_safe((head)->first, __typeof__(*(pos)), member);     \
+         pos;                                                                   \
+         pos = hlist_entry_safe((pos)->member.next, __typeof__(*(pos)), member))
+
+#define hlist_for_each_entry_safe(pos, n, head, member)                         \
+    for (pos = hlist_entry_safe((head)->first, __typeof__(*pos), member);       \
+         pos && ({ n = pos->member.next; 1; });                                 \
+         pos = hlist_entry_safe(n, __typeof__(*pos), member))
+
+/* ==================== RCU (leitores sem custo) ==================== */
+
+#define rcu_read_lock()                 do { } while (0)
+#define rcu_read_unlock()               do { } while (0)
+#define synchronize_rcu()               do { } while (0)
+#define rcu_dereference(p)              READ_ONCE(p)
+#define rcu_dereference_protected(p, c) (p)
+#define lockdep_is_held(l)              1
+#define rcu_assign_pointer(p, v)        smp_store_release(&(p), (v))
+
+#define list_add_rcu(new, head)         list_add(new, head)
+#define list_add_tail_rcu(new, head)    list_add_tail(new, head)
+#define list_del_rcu(entry)             list_del(entry)
+#define list_for_each_entry_rcu(pos, head, member) list_for_each_entry(pos, head, member)
+#define hlist_add_head_rcu(n, h)        hlist_add_head(n, h)
+#define hlist_for_each_entry_rcu(pos, head, member) hlist_for_each_entry(pos, head, member)
+
+/* ==================== hash ==================== */
+
+#define GOLDEN_RATIO_32 0x61C88647
+#define GOLDEN_RATIO_64 0x61C8864680B583EBull
+
+static inline u32 hash_32(u32 val, unsigned int bits) { return (val * GOLDEN_RATIO_32) >> (32 - bits); }
+static inline u32 hash_64(u64 val, unsigned int bits) { return (u32)((val * GOLDEN_RATIO_64) >> (64 - bits)); }
+
+unsigned int full_name_hash(const void *salt, const char *name, unsigned int len);
+
+#define DECLARE_HASHTABLE(name, bits)   struct hlist_head name[1 << (bits)]
+#define HASH_SIZE(name)                 (ARRAY_SIZE(name))
+#define HASH_BITS(name)                 ilog2(HASH_SIZE(name))
+#define hash_min(val, bits) \
+    (sizeof(val) <= 4 ? hash_32(val, bits) : hash_64(val, bits))
+
+#define hash_init(table)                memset((table), 0, sizeof(table))
+#define hash_add(table, node, key)      hlist_add_head(node, &table[hash_min(key, HASH_BITS(table))])
+#define hash_add_rcu(table, node, key)  hash_add(table, node, key)
+#define hash_del(node)                  hlist_del_init(node)
+#define hash_del_rcu(node)              hlist_del_init(node)
+
+#define hash_for_each(name, bkt, obj, member)                           \
+    for ((bkt) = 0, obj = NULL; obj == NULL && (bkt) < (int)HASH_SIZE(name); (bkt)++) \
+        hlist_for_each_entry(obj, &name[bkt], member)
+
+#define hash_for_each_safe(name, bkt, tmp, obj, member)                 \
+    for ((bkt) = 0, obj = NULL; obj == NULL && (bkt) < (int)HASH_SIZE(name); (bkt)++) \
+        hlist_for_each_entry_safe(obj, tmp, &name[bkt], member)
+
+#define hash_for_each_possible(name, obj, member, key) \
+    hlist_for_each_entry(obj, &name[hash_min(key, HASH_BITS(name))], member)
+#define hash_for_each_possible_rcu(name, obj, member, key) \
+    hash_for_each_possible(name, obj, member, key)
+
+/* ==================== log2 e math64 ==================== */
+
+#define ilog2(n) ((int)(63 - __builtin_clzll((unsigned long long)(n) | 1)))
+
+static inline bool is_power_of_2(unsigned long n) { return n != 0 && (n & (n - 1)) == 0; }
+
+static inline unsigned long roundup_pow_of_two(unsigned long n)
+{
+    return n <= 1 ? 1 : 1UL << (64 - __builtin_clzll(n - 1));
+}
+
+static inline u64 div_u64(u64 dividend, u32 divisor) { return dividend / divisor; }
+
+/* ==================== memoria ==================== */
+
+#define PAGE_SHIFT      12
+#define PAGE_SIZE       (1UL << PAGE_SHIFT)
+#define PAGE_ALIGN(x)   ALIGN((unsigned long)(x), PAGE_SIZE)
+
+#define GFP_KERNEL              0u
+#define GFP_ATOMIC              0u
+#define GFP_NOWAIT              0u
+#define GFP_KERNEL_ACCOUNT      0u
+#define __GFP_ZERO              0u
+#define __GFP_NOWARN            0u
+
+#define SLAB_HWCACHE_ALIGN      0u
+#define SLAB_ACCOUNT            0u
+#define SLAB_PANIC              0u
+
+static inline void *kmalloc(size_t size, gfp_t flags) { (void)flags; return malloc(size); }
+static inline void *kzalloc(size_t size, gfp_t flags) { (void)flags; return calloc(1, size); }
+static inline void *kcalloc(size_t n, size_t size, gfp_t flags) { (void)flags; return calloc(n, size); }
+static inline void *kmalloc_array(size_t n, size_t size, gfp_t flags) { (void)flags; return calloc(n, size); }
+static inline void kfree(const void *p) { free((void *)p); }
+static inline void *kvmalloc(size_t size, gfp_t flags) { (void)flags; return malloc(size); }
+static inline void *kvzalloc(size_t size, gfp_t flags) { (void)flags; return calloc(1, size); }
+static inline void *kvmalloc_array(size_t n, size_t size, gfp_t flags) { (void)flags; return calloc(n, size); }
+static inline void kvfree(const void *p) { free((void *)p); }
+static inline void *vmalloc(unsigned long size) { return malloc(size); }
+static inline void *vzalloc(unsigned long size) { return calloc(1, size); }
+static inline void vfree(const void *p) { free((void *)p); }
+static inline void vfree_atomic(const void *p) { free((void *)p); }
+/* Tudo vem do malloc: o broker sempre cai no kfree() */
+static inline bool is_vmalloc_addr(const void *p) { (void)p; return false; }
+
+static inline void *vmalloc_user(unsigned long size)
+{
+    void *p = aligned_alloc(PAGE_SIZE, PAGE_ALIGN(size));
+
+    if (p) {
+        memset(p, 0, PAGE_ALIGN(size));
+    }
+    return p;
+}
+
+static inline char *kstrdup(const char *s, gfp_t flags) { (void)flags; return s ? strdup(s) : NULL; }
+static inline char *kstrndup(const char *s, size_t max, gfp_t flags) { (void)flags; return s ? strndup(s, max) : NULL; }
+
+struct kmem_cache {
+    const char *name;
+    size_t size;
+};
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size, size_t align,
+                                     unsigned long flags, void (*ctor)(void *));
+void kmem_cache_destroy(struct kmem_cache *cache);
+
+/* Envenenado como o SLAB_POISON: campo esquecido no construtor aparece no teste */
+static inline void *kmem_cache_alloc(struct kmem_cache *cache, gfp_t flags)
+{
+    void *p = malloc(cache->size);
+
+    (void)flags;
+    if (p) {
+        memset(p, 0x6b, cache->size);
+    }
+    return p;
+}
+static inline void *kmem_cache_zalloc(struct kmem_cache *cache, gfp_t flags) { (void)flags; return calloc(1, cache->size); }
+static inline void kmem_cache_free(struct kmem_cache *cache, void *p) { (void)cache; free(p); }
+
+/* ==================== locks ==================== */
+
+struct mutex {
+    pthread_mutex_t lock;
+};
+
+static inline void mutex_init(struct mutex *m) { pthread_mutex_init(&m->lock, NULL); }
+static inline void mutex_lock(struct mutex *m) { pthread_mutex_lock(&m->lock); }
+static inline int mutex_lock_interruptible(struct mutex *m) { pthread_mutex_lock(&m->lock); return 0; }
+static inline int mutex_trylock(struct mutex *m) { return pthread_mutex_trylock(&m->lock) == 0; }
+static inline void mutex_unlock(struct mutex *m) { pthread_mutex_unlock(&m->lock); }
+
+struct rw_semaphore {
+    pthread_rwlock_t lock;
+};
+
+static inline void init_rwsem(struct rw_semaphore *s) { pthread_rwlock_init(&s->lock, NULL); }
+static inline void down_read(struct rw_semaphore *s) { pthread_rwlock_rdlock(&s->lock); }
+static inline int down_read_trylock(struct rw_semaphore *s) { return pthread_rwlock_tryrdlock(&s->lock) == 0; }
+static inline void up_read(struct rw_semaphore *s) { pthread_rwlock_unlock(&s->lock); }
+static inline void down_write(struct rw_semaphore *s) { pthread_rwlock_wrlock(&s->lock); }
+static inline void up_write(struct rw_semaphore *s) { pthread_rwlock_unlock(&s->lock); }
+
+typedef struct {
+    pthread_mutex_t lock;
+} spinlock_t;
+
+static inline void spin_lock_init(spinlock_t *l) { pthread_mutex_init(&l->lock, NULL); }
+static inline void spin_lock(spinlock_t *l) { pthread_mutex_lock(&l->lock); }
+static inline void spin_unlock(spinlock_t *l) { pthread_mutex_unlock(&l->lock); }
+#define spin_lock_irqsave(l, flags)       do { (void)(flags); spin_lock(l); } while (0)
+#define spin_unlock_irqrestore(l, flags)  do { (void)(flags); spin_unlock(l); } while (0)
+
+/* ==================== wait queues ==================== */
+
+#define HZ 1000
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} wait_queue_head_t;
+
+static inline void init_waitqueue_head(wait_queue_head_t *wq)
+{
+    pthread_mutex_init(&wq->lock, NULL);
+    pthread_cond_init(&wq->cond, NULL);
+}
+
+static inline void wake_up_all(wait_queue_head_t *wq)
+{
+    pthread_mutex_lock(&wq->lock);
+    pthread_cond_broadcast(&wq->cond);
+    pthread_mutex_unlock(&wq->lock);
+}
+
+#define wake_up(wq)                         wake_up_all(wq)
+#define wake_up_interruptible(wq)           wake_up_all(wq)
+#define wake_up_interruptible_all(wq)       wake_up_all(wq)
+
+static inline unsigned long msecs_to_jiffies(unsigned int ms) { return ms; }
+
+/* Espera ate um tick (1 ms) por um wake_up */
+void host_wait_tick(wait_queue_head_t *wq);
+
+/* Devolve os jiffies restantes (>= 1) se a condicao virou, 0 no timeout */
+#define wait_event_interruptible_timeout(wq, condition, timeout)        \
+    ({                                                                  \
+        long __remaining = (timeout);                                   \
+        while (!(condition) && __remaining > 0) {                       \
+            host_wait_tick(&(wq));                                      \
+            __remaining--;                                              \
+        }                                                               \
+        (condition) ? (__remaining > 0 ? __remaining : 1) : 0;          \
+    })
+
+/* ==================== percpu (uma CPU) ==================== */
+
+/* host_alloc_percpu_fail > 0: as proximas alocacoes falham (testes de erro) */
+extern int host_alloc_percpu_fail;
+void *host_alloc_percpu(size_t size);
+#define alloc_percpu(type)          ((type *)host_alloc_percpu(sizeof(type)))
+#define free_percpu(p)              free(p)
+#define per_cpu_ptr(p, cpu)         ((void)(cpu), (p))
+#define for_each_possible_cpu(cpu)  for ((cpu) = 0; (cpu) < 1; (cpu)++)
+#define this_cpu_add(pcp, val)      ((void)__atomic_add_fetch(&(pcp), (val), __ATOMIC_RELAXED))
+#define this_cpu_inc(pcp)           this_cpu_add(pcp, 1)
+
+struct percpu_counter {
+    s64 count;
+};
+
+static inline int percpu_counter_init(struct percpu_counter *fbc, s64 amount, gfp_t gfp)
+{
+    (void)gfp;
+    fbc->count = amount;
+    return 0;
+}
+
+static inline void percpu_counter_destroy(struct percpu_counter *fbc) { (void)fbc; }
+static inline void percpu_counter_add(struct percpu_counter *fbc, s64 amount) { __atomic_add_fetch(&fbc->count, amount, __ATOMIC_RELAXED); }
+static inline void percpu_counter_sub(struct percpu_counter *fbc, s64 amount) { percpu_counter_add(fbc, -amount); }
+static inline void percpu_counter_add_batch(struct percpu_counter *fbc, s64 amount, s32 batch) { (void)batch; percpu_counter_add(fbc, amount); }
+static inline void percpu_counter_inc(struct percpu_counter *fbc) { percpu_counter_add(fbc, 1); }
+static inline void percpu_counter_dec(struct percpu_counter *fbc) { percpu_counter_add(fbc, -1); }
+static inline s64 percpu_counter_sum(struct percpu_counter *fbc) { return __atomic_load_n(&fbc->count, __ATOMIC_RELAXED); }
+static inline s64 percpu_counter_read(struct percpu_counter *fbc) { return percpu_counter_sum(fbc); }
+
+static inline s64 percpu_counter_read_positive(struct percpu_counter *fbc)
+{
+    s64 count = percpu_counter_sum(fbc);
+
+    return count > 0 ? count : 0;
+}
+
+#define percpu_counter_sum_positive(fbc) percpu_counter_read_positive(fbc)
+
+static inline int percpu_counter_compare(struct percpu_counter *fbc, s64 rhs)
+{
+    s64 count = percpu_counter_sum(fbc);
+
+    return count > rhs ? 1 : (count < rhs ? -1 : 0);
+}
+
+static inline int __percpu_counter_compare(struct percpu_counter *fbc, s64 rhs, s32 batch)
+{
+    (void)batch;
+    return percpu_counter_compare(fbc, rhs);
+}
+
+/* ==================== idr ==================== */
+
+struct idr {
+    void **ptrs;
+    int size;
+    int hint;       /* menor id possivelmente livre */
+};
+
+void idr_init(struct idr *idr);
+int idr_alloc(struct idr *idr, void *ptr, int start, int end, gfp_t gfp);
+void *idr_find(const struct idr *idr, unsigned long id);
+void *idr_get_next(struct idr *idr, int *nextid);
+
+#define idr_for_each_entry(idr, entry, id) \
+    for (id = 0; ((entry) = idr_get_next(idr, &(id))) != NULL; ++id)
+void *idr_remove(struct idr *idr, unsigned long id);
+void idr_destroy(struct idr *idr);
+
+/* ==================== shrinker ==================== */
+
+#define DEFAULT_SEEKS   2
+#define SHRINK_STOP     (~0UL)
+
+struct shrink_control {
+    gfp_t gfp_mask;
+    unsigned long nr_to_scan;
+    unsigned long nr_scanned;
+};
+
+struct shrinker {
+    unsigned long (*count_objects)(struct shrinker *, struct shrink_control *sc);
+    unsigned long (*scan_objects)(struct shrinker *, struct shrink_control *sc);
+    long batch;
+    int seeks;
+    unsigned int flags;
+};
+
+/* Nunca chamado sozinho; testes e benchmark chamam os callbacks pelo host_shrinker */
+extern struct shrinker *host_shrinker;
+static inline int register_shrinker(struct shrinker *s) { host_shrinker = s; return 0; }
+static inline void unregister_shrinker(struct shrinker *s) { (void)s; host_shrinker = NULL; }
+
+/* ==================== workqueues (execucao imediata) ==================== */
+
+#define WQ_UNBOUND      (1 << 1)
+#define WQ_MEM_RECLAIM  (1 << 3)
+
+struct work_struct;
+typedef void (*work_func_t)(struct work_struct *work);
+
+struct work_struct {
+    work_func_t func;
+};
+
+struct workqueue_struct {
+    const char *name;
+};
+
+#define INIT_WORK(w, f)     ((w)->func = (f))
+
+struct workqueue_struct *alloc_workqueue(const char *name, unsigned int flags, int max_active, ...);
+void destroy_workqueue(struct workqueue_struct *wq);
+
+/* O work roda no proprio chamador: a ordem e a do kernel com uma CPU */
+static inline bool queue_work(struct workqueue_struct *wq, struct work_struct *work)
+{
+    (void)wq;
+    work->func(work);
+    return true;
+}
+
+static inline bool flush_work(struct work_struct *work) { (void)work; return false; }
+
+static inline unsigned int num_online_cpus(void) { return 1; }
+
+struct completion {
+    unsigned int done;
+};
+
+static inline void init_completion(struct completion *c) { c->done = 0; }
+static inline void complete(struct completion *c) { c->done++; }
+/* Com queue_work() sincrono o complete() ja aconteceu */
+static inline void wait_for_completion(struct completion *c) { (void)c; }
+
+#define wait_event_interruptible(wq, condition)                         \
+    ({                                                                  \
+        while (!(condition)) {                                          \
+            host_wait_tick(&(wq));                                      \
+        }                                                               \
+        0;                                                              \
+    })
+
+/* ==================== tempo ==================== */
+
+#define NSEC_PER_MSEC   1000000L
+
+static inline u64 ktime_get_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* ==================== seq_file ==================== */
+
+struct seq_file {
+    FILE *file;
+};
+
+int seq_printf(struct seq_file *m, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static inline void seq_puts(struct seq_file *m, const char *s) { fputs(s, m->file); }
+static inline void seq_putc(struct seq_file *m, char c) { fputc(c, m->file); }
+
+/* ==================== tracepoints ==================== */
+
+#define TP_PROTO(...)       __VA_ARGS__
+#define TP_ARGS(...)        __VA_ARGS__
+#define TRACE_EVENT(name, proto, args, tstruct, assign, print) \
+    static inline void trace_##name(proto) { }
+
+#endif
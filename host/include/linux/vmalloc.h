@@ -0,0 +1,2 @@
+/* Shim de userspace: ver host_kernel.h */
+#include "../host_kernel.h"
@@ -0,0 +1 @@
+/* Sem CREATE_TRACE_POINTS no host: nada a definir */
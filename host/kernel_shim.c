@@ -0,0 +1,182 @@
+/*
+ * Parte nao inline do shim de host_kernel.h.
+ */
+#include "host_kernel.h"
+
+int host_printk_enabled;
+int host_alloc_percpu_fail;
+struct shrinker *host_shrinker;
+
+int printk(const char *fmt, ...)
+{
+    va_list args;
+    int ret;
+
+    if (!host_printk_enabled) {
+        return 0;
+    }
+    va_start(args, fmt);
+    ret = vfprintf(stderr, fmt, args);
+    va_end(args);
+    return ret;
+}
+
+/* FNV-1a: nao e o hash do kernel, mas espalha nomes parecidos do mesmo jeito */
+unsigned int full_name_hash(const void *salt, const char *name, unsigned int len)
+{
+    u32 hash = 2166136261u ^ (u32)(uintptr_t)salt;
+    unsigned int i;
+
+    for (i = 0; i < len; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+void *host_alloc_percpu(size_t size)
+{
+    if (host_alloc_percpu_fail > 0) {
+        host_alloc_percpu_fail--;
+        return NULL;
+    }
+    return calloc(1, size);
+}
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size, size_t align,
+                                     unsigned long flags, void (*ctor)(void *))
+{
+    struct kmem_cache *cache = malloc(sizeof(*cache));
+
+    (void)align;
+    (void)flags;
+    (void)ctor;
+    if (cache) {
+        cache->name = name;
+        cache->size = size;
+    }
+    return cache;
+}
+
+void kmem_cache_destroy(struct kmem_cache *cache)
+{
+    free(cache);
+}
+
+struct workqueue_struct *alloc_workqueue(const char *name, unsigned int flags, int max_active, ...)
+{
+    struct workqueue_struct *wq = malloc(sizeof(*wq));
+
+    (void)flags;
+    (void)max_active;
+    if (wq) {
+        wq->name = name;
+    }
+    return wq;
+}
+
+void destroy_workqueue(struct workqueue_struct *wq)
+{
+    free(wq);
+}
+
+void idr_init(struct idr *idr)
+{
+    idr->ptrs = NULL;
+    idr->size = 0;
+    idr->hint = 0;
+}
+
+int idr_alloc(struct idr *idr, void *ptr, int start, int end, gfp_t gfp)
+{
+    int limit = end > 0 ? end : INT_MAX;
+    int id = max(start, idr->hint);
+    void **grown;
+    int size;
+
+    (void)gfp;
+    while (id < idr->size && idr->ptrs[id]) {
+        id++;
+    }
+    if (id >= limit) {
+        return -ENOSPC;
+    }
+    if (id >= idr->size) {
+        size = max(idr->size * 2, id + 64);
+        grown = realloc(idr->ptrs, size * sizeof(*grown));
+        if (!grown) {
+            return -ENOMEM;
+        }
+        memset(grown + idr->size, 0, (size - idr->size) * sizeof(*grown));
+        idr->ptrs = grown;
+        idr->size = size;
+    }
+    idr->ptrs[id] = ptr;
+    if (start <= idr->hint) {
+        idr->hint = id + 1;
+    }
+    return id;
+}
+
+void *idr_find(const struct idr *idr, unsigned long id)
+{
+    return id < (unsigned long)idr->size ? idr->ptrs[id] : NULL;
+}
+
+void *idr_get_next(struct idr *idr, int *nextid)
+{
+    int id;
+
+    for (id = max(*nextid, 0); id < idr->size; id++) {
+        if (idr->ptrs[id]) {
+            *nextid = id;
+            return idr->ptrs[id];
+        }
+    }
+    return NULL;
+}
+
+void *idr_remove(struct idr *idr, unsigned long id)
+{
+    void *ptr = idr_find(idr, id);
+
+    if (ptr) {
+        idr->ptrs[id] = NULL;
+        if ((int)id < idr->hint) {
+            idr->hint = id;
+        }
+    }
+    return ptr;
+}
+
+void idr_destroy(struct idr *idr)
+{
+    free(idr->ptrs);
+    idr_init(idr);
+}
+
+int seq_printf(struct seq_file *m, const char *fmt, ...)
+{
+    va_list args;
+    int ret;
+
+    va_start(args, fmt);
+    ret = vfprintf(m->file, fmt, args);
+    va_end(args);
+    return ret;
+}
+
+void host_wait_tick(wait_queue_head_t *wq)
+{
+    struct timespec deadline;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    pthread_mutex_lock(&wq->lock);
+    pthread_cond_timedwait(&wq->cond, &wq->lock, &deadline);
+    pthread_mutex_unlock(&wq->lock);
+}
@@ -0,0 +1,632 @@
+/*
+ * Testes do broker.c em userspace (make host-test). Cada teste sobe o
+ * broker do zero e confere o comportamento visivel pela API: criacao e
+ * busca de topicos, registro de inscritos, politicas da mailbox, curingas,
+ * modo log, mensagem retida, fan-out assincrono, o orcamento de memoria e
+ * o shrinker. Imprime uma linha por teste e sai com 1 se algum falhar.
+ *
+ *   ./host/test_broker
+ */
+#include "host_kernel.h"
+#include "broker.h"
+
+/* Parametros do modulo, definidos em main_driver.c no kernel */
+int max_msg_size = DEFAULT_MAX_MSG_SIZE;
+int max_msg_n = DEFAULT_MAX_MSG_N;
+unsigned long max_queued_bytes = DEFAULT_MAX_QUEUED_BYTES;
+int topic_hash_bits = BROKER_HASH_BITS;
+
+#define TEST_MAILBOX_SIZE   4
+#define TEST_NAME_MAX       64
+/* Topicos suficientes para a tabela dobrar algumas vezes */
+#define TEST_TOPICS         5000
+/* Payload grande o bastante para o shrinker contar em paginas */
+#define TEST_BIG_SIZE       3000
+
+static int failures;
+
+#define CHECK(cond)                                                             \
+    do {                                                                        \
+        if (!(cond)) {                                                          \
+            printf("  %s:%d: falhou: %s\n", __FILE__, __LINE__, #cond);         \
+            failures++;                                                         \
+        }                                                                       \
+    } while (0)
+
+static void broker_start(void)
+{
+    if (broker_init()) {
+        fprintf(stderr, "broker_init failed\n");
+        exit(1);
+    }
+}
+
+static void publish(topic_s *topic, const char *text)
+{
+    CHECK(topic_publish_message(topic, text, strlen(text)) == 0);
+}
+
+/* Confere que a proxima mensagem da mailbox e 'text' (NULL: vazia) */
+static void expect_pop(process_s *process, const char *text)
+{
+    payload_s *payload = mailbox_pop(process);
+
+    if (!text) {
+        CHECK(payload == NULL);
+        if (payload && !IS_ERR(payload)) {
+            payload_put(payload);
+        }
+        return;
+    }
+    CHECK(payload && !IS_ERR(payload));
+    if (!payload || IS_ERR(payload)) {
+        return;
+    }
+    CHECK(payload->size == strlen(text) && !memcmp(payload->data, text, payload->size));
+    payload_put(payload);
+}
+
+/* Publica TEST_BIG_SIZE bytes de 'fill' */
+static int publish_big(topic_s *topic, char fill)
+{
+    static char big[TEST_BIG_SIZE];
+
+    memset(big, fill, sizeof(big));
+    return topic_publish_message(topic, big, sizeof(big));
+}
+
+/* Confere que a proxima mensagem e um publish_big() de 'fill' */
+static void expect_pop_big(process_s *process, char fill)
+{
+    payload_s *payload = mailbox_pop(process);
+
+    CHECK(payload && !IS_ERR(payload));
+    if (!payload || IS_ERR(payload)) {
+        return;
+    }
+    CHECK(payload->size == TEST_BIG_SIZE && payload->data[0] == fill);
+    payload_put(payload);
+}
+
+/* Publica 'count' copias de 'text' de uma vez; devolve o retorno do broker */
+static int publish_n(topic_s *topic, const char *text, unsigned int count)
+{
+    payload_s *payloads[DEFAULT_MAX_MSG_N];
+    unsigned int i;
+    int ret;
+
+    for (i = 0; i < count; i++) {
+        payloads[i] = payload_create(text, strlen(text));
+    }
+    ret = topic_publish_payloads(topic, payloads, count);
+    for (i = 0; i < count; i++) {
+        payload_put(payloads[i]);
+    }
+    return ret;
+}
+
+static u64 topic_dropped(topic_s *topic)
+{
+    u64 dropped = 0;
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        dropped += per_cpu_ptr(topic->stats, cpu)->dropped;
+    }
+    return dropped;
+}
+
+static u64 elapsed_ms(u64 start_ns)
+{
+    return (ktime_get_ns() - start_ns) / NSEC_PER_MSEC;
+}
+
+static process_s *subscribe(const char *name, int pid)
+{
+    topic_s *topic;
+
+    CHECK(register_process_to_topic(name, 's', pid, &topic) == 0);
+    return topic_get_subscriber(topic, pid);
+}
+
+/* Inscreve com uma mailbox de TEST_MAILBOX_SIZE mensagens */
+static process_s *subscribe_small(const char *name, int pid)
+{
+    process_s *process;
+
+    max_msg_n = TEST_MAILBOX_SIZE;
+    process = subscribe(name, pid);
+    max_msg_n = DEFAULT_MAX_MSG_N;
+    return process;
+}
+
+static void test_find_create(void)
+{
+    char name[TEST_NAME_MAX];
+    topic_s *topic;
+    int i, missing = 0;
+
+    broker_start();
+    CHECK(find_topic("a/b") == NULL);
+    topic = find_or_create_topic("a/b");
+    CHECK(!IS_ERR(topic));
+    CHECK(find_or_create_topic("a/b") == topic);
+    CHECK(find_topic("a/b") == topic);
+    CHECK(find_topic_by_handle(topic->id) == topic);
+    CHECK(find_topic("a") == NULL);
+    CHECK(PTR_ERR(find_or_create_topic("a/#/b")) == -EINVAL);
+    CHECK(PTR_ERR(find_or_create_topic("a/b+")) == -EINVAL);
+
+    for (i = 0; i < TEST_TOPICS; i++) {
+        snprintf(name, sizeof(name), "grow/%d", i);
+        CHECK(!IS_ERR(find_or_create_topic(name)));
+    }
+    for (i = 0; i < TEST_TOPICS; i++) {
+        snprintf(name, sizeof(name), "grow/%d", i);
+        topic = find_topic(name);
+        missing += !topic || strcmp(topic->name, name);
+    }
+    CHECK(missing == 0);
+    CHECK(find_topic("a/b") != NULL);
+    broker_exit();
+}
+
+static void test_register_unregister(void)
+{
+    topic_s *topic;
+
+    broker_start();
+    CHECK(register_process_to_topic("t", 's', 1, &topic) == 0);
+    CHECK(is_pid_in_subscribers(1, topic));
+    CHECK(topic->nr_subscribers == 1);
+    /* Registrar de novo nao duplica */
+    CHECK(register_process_to_topic("t", 's', 1, NULL) == 0);
+    CHECK(topic->nr_subscribers == 1);
+    CHECK(register_process_to_topic("t", 'p', 2, NULL) == 0);
+    CHECK(is_pid_in_publishers(2, topic));
+    CHECK(!is_pid_in_subscribers(2, topic));
+    CHECK(register_process_to_topic("t", 'x', 3, NULL) == -EINVAL);
+
+    topic_remove_subscriber(topic, 1);
+    CHECK(!is_pid_in_subscribers(1, topic));
+    CHECK(topic->nr_subscribers == 0);
+    CHECK(topic_get_subscriber(topic, 1) == NULL);
+    publish(topic, "m0");
+    broker_exit();
+}
+
+static void test_mailbox_overwrite(void)
+{
+    process_s *process;
+    topic_s *topic;
+
+    broker_start();
+    process = subscribe_small("t", 1);
+    topic = process->topic;
+    publish(topic, "m0");
+    publish(topic, "m1");
+    publish(topic, "m2");
+    publish(topic, "m3");
+    publish(topic, "m4");
+    publish(topic, "m5");
+    /* Mailbox cheia: as mais antigas saem */
+    CHECK(mailbox_pending(process) == TEST_MAILBOX_SIZE);
+    expect_pop(process, "m2");
+    expect_pop(process, "m3");
+    expect_pop(process, "m4");
+    expect_pop(process, "m5");
+    expect_pop(process, NULL);
+    CHECK(process->overwritten == 2);
+    process_put(process);
+    broker_exit();
+}
+
+static void test_mailbox_drop(void)
+{
+    struct pubsub_topic_config config = { .set = PUBSUB_CONFIG_POLICY, .policy = PUBSUB_POLICY_DROP_NEWEST };
+    process_s *process;
+    topic_s *topic;
+
+    broker_start();
+    topic = find_or_create_topic("t");
+    CHECK(topic_configure(topic, &config) == 0);
+    process = subscribe_small("t", 1);
+    publish(topic, "m0");
+    publish(topic, "m1");
+    publish(topic, "m2");
+    publish(topic, "m3");
+    topic_publish_message(topic, "m4", 2);
+    topic_publish_message(topic, "m5", 2);
+    /* Mailbox cheia: as novas sao descartadas */
+    expect_pop(process, "m0");
+    expect_pop(process, "m1");
+    expect_pop(process, "m2");
+    expect_pop(process, "m3");
+    expect_pop(process, NULL);
+    process_put(process);
+    broker_exit();
+}
+
+static void test_wildcards(void)
+{
+    process_s *plus, *hash, *root, *sys;
+    topic_s *topic;
+
+    broker_start();
+    plus = subscribe("s/+/temp", 1);
+    hash = subscribe("s/#", 2);
+    root = subscribe("+/x", 3);
+    sys = subscribe("$sys/#", 4);
+
+    publish(find_or_create_topic("s/k/temp"), "temp");
+    publish(find_or_create_topic("s/k/hum"), "hum");
+    publish(find_or_create_topic("s"), "s");
+    publish(find_or_create_topic("s/x"), "sx");
+    publish(find_or_create_topic("s/k/temp/deep"), "deep");
+    /* '$' na raiz: so um filtro com o mesmo primeiro nivel casa */
+    publish(find_or_create_topic("$sys/x"), "sys");
+
+    expect_pop(plus, "temp");
+    expect_pop(plus, NULL);
+    expect_pop(hash, "temp");
+    expect_pop(hash, "hum");
+    expect_pop(hash, "s");
+    expect_pop(hash, "sx");
+    expect_pop(hash, "deep");
+    expect_pop(hash, NULL);
+    expect_pop(root, "sx");
+    expect_pop(root, NULL);
+    expect_pop(sys, "sys");
+    expect_pop(sys, NULL);
+
+    /* Filtros so servem para inscricao */
+    topic = find_topic("s/#");
+    CHECK(topic && topic_publish_message(topic, "x", 1) == -EINVAL);
+
+    process_put(plus);
+    process_put(hash);
+    process_put(root);
+    process_put(sys);
+    broker_exit();
+}
+
+static void test_log_seek_overflow(void)
+{
+    struct pubsub_topic_config config = { .set = PUBSUB_CONFIG_LOG, .log_entries = 8 };
+    struct pubsub_log_status status;
+    process_s *process;
+    topic_s *topic;
+    char text[8];
+    int i;
+
+    broker_start();
+    topic = find_or_create_topic("log");
+    CHECK(topic_configure(topic, &config) == 0);
+    process = subscribe("log", 1);
+    /* Com inscritos o modo log nao muda */
+    CHECK(topic_configure(topic, &config) == -EBUSY);
+
+    for (i = 0; i < 3; i++) {
+        snprintf(text, sizeof(text), "m%d", i);
+        publish(topic, text);
+    }
+    CHECK(mailbox_pending(process) == 3);
+    expect_pop(process, "m0");
+
+    /* Passa do tamanho do log: a posicao 1 foi sobrescrita */
+    for (i = 3; i < 12; i++) {
+        snprintf(text, sizeof(text), "m%d", i);
+        publish(topic, text);
+    }
+    CHECK(PTR_ERR(mailbox_pop(process)) == -EOVERFLOW);
+    CHECK(topic_log_status(process, &status) == 0);
+    CHECK(status.position == 1 && status.first == 4 && status.head == 12 && status.lost == 3);
+
+    CHECK(topic_log_seek(process, 0, SEEK_SET) == -EINVAL);
+    CHECK(topic_log_seek(process, 4, SEEK_SET) == 4);
+    expect_pop(process, "m4");
+    CHECK(topic_log_seek(process, 1, SEEK_CUR) == 6);
+    expect_pop(process, "m6");
+    CHECK(topic_log_seek(process, -2, SEEK_END) == 10);
+    expect_pop(process, "m10");
+    expect_pop(process, "m11");
+    expect_pop(process, NULL);
+    CHECK(topic_log_seek(process, 1, SEEK_END) == -EINVAL);
+
+    process_put(process);
+    broker_exit();
+}
+
+static void test_retained(void)
+{
+    struct pubsub_topic_config config = { .set = PUBSUB_CONFIG_RETAIN, .retain = 1 };
+    process_s *first, *second, *third;
+    topic_s *topic;
+
+    broker_start();
+    topic = find_or_create_topic("r");
+    CHECK(topic_configure(topic, &config) == 0);
+    publish(topic, "v1");
+    publish(topic, "v2");
+    /* Quem chega depois recebe so a ultima */
+    first = subscribe("r", 1);
+    expect_pop(first, "v2");
+    expect_pop(first, NULL);
+    publish(topic, "v3");
+    expect_pop(first, "v3");
+    second = subscribe("r", 2);
+    expect_pop(second, "v3");
+
+    /* Desligar o retain descarta a retida */
+    config.retain = 0;
+    CHECK(topic_configure(topic, &config) == 0);
+    third = subscribe("r", 3);
+    expect_pop(third, NULL);
+
+    /* Falha no meio de create_topic(): topic_free() nao pode ler lixo */
+    host_alloc_percpu_fail = 1;
+    CHECK(PTR_ERR(find_or_create_topic("r/fail")) == -ENOMEM);
+    CHECK(find_topic("r/fail") == NULL);
+    CHECK(!IS_ERR(find_or_create_topic("r/fail")));
+
+    process_put(first);
+    process_put(second);
+    process_put(third);
+    broker_exit();
+}
+
+static void test_async_flush(void)
+{
+    struct pubsub_topic_config async = { .set = PUBSUB_CONFIG_ASYNC, .async = 1 };
+    struct pubsub_topic_config block = {
+        .set = PUBSUB_CONFIG_POLICY | PUBSUB_CONFIG_BLOCK_TIMEOUT,
+        .policy = PUBSUB_POLICY_BLOCK,
+        .block_timeout_ms = 1000,
+    };
+    process_s *process, *blocked;
+    topic_s *topic;
+    u64 start;
+    int i;
+
+    broker_start();
+    topic = find_or_create_topic("q/x");
+    CHECK(topic_configure(topic, &async) == 0);
+    process = subscribe("q/x", 1);
+    publish(topic, "m0");
+    publish(topic, "m1");
+    CHECK(topic_flush(topic) == 0);
+    CHECK(topic->async_queued == 2 && topic->async_done == 2);
+    expect_pop(process, "m0");
+    expect_pop(process, "m1");
+    expect_pop(process, NULL);
+
+    /*
+     * Filtro BLOCK cheio: o worker nao espera por espaco, descarta o lote
+     * inteiro (para todos os inscritos) e conta em dropped.
+     */
+    CHECK(topic_configure(find_or_create_topic("q/+"), &block) == 0);
+    blocked = subscribe_small("q/+", 2);
+    start = ktime_get_ns();
+    for (i = 0; i < TEST_MAILBOX_SIZE + 2; i++) {
+        publish(topic, "b");
+    }
+    CHECK(topic_flush(topic) == 0);
+    CHECK(elapsed_ms(start) < block.block_timeout_ms);
+    CHECK(topic->async_done == topic->async_queued);
+    CHECK(topic_dropped(topic) == 2);
+    CHECK(mailbox_pending(blocked) == TEST_MAILBOX_SIZE);
+    CHECK(mailbox_pending(process) == TEST_MAILBOX_SIZE);
+
+    process_put(process);
+    process_put(blocked);
+    broker_exit();
+}
+
+static void test_block_all_or_nothing(void)
+{
+    struct pubsub_topic_config config = {
+        .set = PUBSUB_CONFIG_POLICY | PUBSUB_CONFIG_BLOCK_TIMEOUT,
+        .policy = PUBSUB_POLICY_BLOCK,
+        .block_timeout_ms = 5,
+    };
+    process_s *plain, *blocked;
+    topic_s *topic;
+    u64 start;
+
+    broker_start();
+    topic = find_or_create_topic("a/b");
+    CHECK(topic_configure(find_or_create_topic("a/+"), &config) == 0);
+    plain = subscribe_small("a/b", 1);
+    blocked = subscribe_small("a/+", 2);
+    /* Lotes do tamanho da mailbox, para o corte parcial aparecer */
+    max_msg_n = TEST_MAILBOX_SIZE;
+
+    CHECK(publish_n(topic, "m", 3) == 3);
+    CHECK(mailbox_pending(plain) == 3 && mailbox_pending(blocked) == 3);
+
+    /* Nao cabe inteiro: espera o timeout e nao entrega a ninguem */
+    start = ktime_get_ns();
+    CHECK(publish_n(topic, "m", 2) == -EAGAIN);
+    CHECK(elapsed_ms(start) >= config.block_timeout_ms);
+    CHECK(mailbox_pending(plain) == 3 && mailbox_pending(blocked) == 3);
+
+    /* Com espaco, sai o primeiro lote inteiro e o resto fica */
+    expect_pop(blocked, "m");
+    expect_pop(blocked, "m");
+    expect_pop(blocked, "m");
+    CHECK(publish_n(topic, "m", 6) == TEST_MAILBOX_SIZE);
+    CHECK(mailbox_pending(blocked) == TEST_MAILBOX_SIZE);
+
+    max_msg_n = DEFAULT_MAX_MSG_N;
+    process_put(plain);
+    process_put(blocked);
+    broker_exit();
+}
+
+static void test_memory_budget(void)
+{
+    process_s *process;
+    topic_s *topic;
+    size_t ring_size;
+
+    broker_start();
+    process = subscribe("t", 1);
+    topic = process->topic;
+
+    /* O anel do mmap nao cabe num orcamento de uma pagina */
+    max_queued_bytes = PAGE_SIZE;
+    CHECK(process_attach_mmap_ring(process) == -ENOMEM);
+    CHECK(process->mmap == NULL);
+
+    /* Slot limitado mesmo com max_msg_size grande */
+    max_queued_bytes = DEFAULT_MAX_QUEUED_BYTES;
+    max_msg_size = MAX_MSG_SIZE_LIMIT;
+    CHECK(process_attach_mmap_ring(process) == 0);
+    max_msg_size = DEFAULT_MAX_MSG_SIZE;
+    CHECK(process->mmap != NULL);
+    if (!process->mmap) {
+        process_put(process);
+        broker_exit();
+        return;
+    }
+    CHECK(process->mmap->slot_size <= sizeof(struct pubsub_mmap_slot) + MMAP_SLOT_PAYLOAD_MAX + 8);
+    ring_size = process->mmap->size;
+
+    /* O anel ja ocupa o orcamento: o payload nao entra */
+    max_queued_bytes = ring_size + TEST_BIG_SIZE / 2;
+    CHECK(publish_big(topic, 'a') == -ENOMEM);
+    CHECK(per_cpu_ptr(topic->stats, 0)->alloc_failed == 1);
+
+    /* Ao sair o inscrito o anel devolve o que cobrou */
+    topic_remove_subscriber(topic, 1);
+    process_put(process);
+    CHECK(publish_big(topic, 'b') == 0);
+
+    max_queued_bytes = DEFAULT_MAX_QUEUED_BYTES;
+    broker_exit();
+}
+
+static void test_shrinker(void)
+{
+    struct shrink_control sc = { .gfp_mask = GFP_KERNEL };
+    process_s *first, *second;
+    unsigned long before;
+    topic_s *topic;
+
+    broker_start();
+    CHECK(host_shrinker != NULL);
+    if (!host_shrinker) {
+        broker_exit();
+        return;
+    }
+    first = subscribe("t", 1);
+    second = subscribe("t", 2);
+    topic = first->topic;
+    CHECK(publish_big(topic, 'a') == 0);
+    CHECK(publish_big(topic, 'b') == 0);
+    CHECK(publish_big(topic, 'c') == 0);
+    CHECK(publish_big(topic, 'd') == 0);
+
+    before = host_shrinker->count_objects(host_shrinker, &sc);
+    CHECK(before >= 2);
+
+    /*
+     * Payload compartilhado so libera quando sai das duas mailboxes: uma
+     * pagina pedida tira as duas mais antigas de cada inscrito.
+     */
+    sc.nr_to_scan = 1;
+    CHECK(host_shrinker->scan_objects(host_shrinker, &sc) == 1);
+    CHECK(host_shrinker->count_objects(host_shrinker, &sc) < before);
+    CHECK(mailbox_pending(first) == 2 && mailbox_pending(second) == 2);
+    expect_pop_big(first, 'c');
+    expect_pop_big(first, 'd');
+    expect_pop_big(second, 'c');
+    expect_pop_big(second, 'd');
+
+    /* Mailboxes vazias: nada a contar nem a liberar */
+    CHECK(host_shrinker->count_objects(host_shrinker, &sc) == 0);
+    CHECK(host_shrinker->scan_objects(host_shrinker, &sc) == 0);
+
+    process_put(first);
+    process_put(second);
+    broker_exit();
+}
+
+/*
+ * Base da leitura em lote de main_driver.c: uma mensagem que nao cabe fica
+ * na fila e informa o tamanho (o read devolve EMSGSIZE).
+ */
+static void test_batch_read_fits(void)
+{
+    struct pubsub_topic_config config = { .set = PUBSUB_CONFIG_LOG, .log_entries = 8 };
+    process_s *processes[2];
+    payload_s *payload;
+    size_t needed;
+    int i;
+
+    broker_start();
+    CHECK(topic_configure(find_or_create_topic("log"), &config) == 0);
+    processes[0] = subscribe("t", 1);
+    processes[1] = subscribe("log", 2);
+
+    for (i = 0; i < 2; i++) {
+        publish(processes[i]->topic, "abc");
+        publish(processes[i]->topic, "defgh");
+        CHECK(mailbox_next_size(processes[i]) == 3);
+
+        payload = mailbox_pop_if_fits(processes[i], 2, &needed);
+        CHECK(payload == NULL && needed == 3);
+        CHECK(mailbox_pending(processes[i]) == 2);
+
+        payload = mailbox_pop_if_fits(processes[i], 3, &needed);
+        CHECK(payload && !IS_ERR(payload) && payload->size == 3 && !memcmp(payload->data, "abc", 3));
+        if (payload && !IS_ERR(payload)) {
+            payload_put(payload);
+        }
+        CHECK(mailbox_next_size(processes[i]) == 5);
+
+        payload = mailbox_pop_if_fits(processes[i], 100, &needed);
+        CHECK(payload && !IS_ERR(payload) && payload->size == 5 && !memcmp(payload->data, "defgh", 5));
+        if (payload && !IS_ERR(payload)) {
+            payload_put(payload);
+        }
+
+        /* Vazia: nada sai e nada e pedido */
+        payload = mailbox_pop_if_fits(processes[i], 100, &needed);
+        CHECK(payload == NULL && needed == 0);
+        CHECK(mailbox_next_size(processes[i]) == 0);
+        process_put(processes[i]);
+    }
+    broker_exit();
+}
+
+static const struct {
+    const char *name;
+    void (*fn)(void);
+} tests[] = {
+    { "find_create", test_find_create },
+    { "register_unregister", test_register_unregister },
+    { "mailbox_overwrite", test_mailbox_overwrite },
+    { "mailbox_drop", test_mailbox_drop },
+    { "wildcards", test_wildcards },
+    { "log_seek_overflow", test_log_seek_overflow },
+    { "retained", test_retained },
+    { "async_flush", test_async_flush },
+    { "block_all_or_nothing", test_block_all_or_nothing },
+    { "memory_budget", test_memory_budget },
+    { "shrinker", test_shrinker },
+    { "batch_read_fits", test_batch_read_fits },
+};
+
+int main(void)
+{
+    unsigned int i;
+    int before;
+
+    for (i = 0; i < ARRAY_SIZE(tests); i++) {
+        before = failures;
+        tests[i].fn();
+        printf("%s %s\n", failures == before ? "ok" : "FAIL", tests[i].name);
+    }
+    return failures ? 1 : 0;
+}
@@ -9,9 +9,18 @@
 #include <linux/string.h>
 #include <linux/sched.h>
 #include <linux/moduleparam.h>
+#include <linux/atomic.h>
+#include <linux/poll.h>
+#include <linux/mm.h>
+#include <linux/uio.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 
 #include "broker.h"
 
+#define CREATE_TRACE_POINTS
+#include "pubsub_trace.h"
+
 /*
 INICIALIZACAO E CONFIG DO DRIVER
 */
@@ -19,38 +28,176 @@ INICIALIZACAO E CONFIG DO DRIVER
 #define DEVICE_NAME "pubsub_driver"
 #define CLASS_NAME  "pubsub_class"
 #define MAX_COMMAND_LENGTH 128
+/* Copias de/para o usuario em pedacos, cedendo a CPU entre eles */
+#define COPY_CHUNK (16 * PAGE_SIZE)
 
 MODULE_LICENSE("GPL");
 
 static int majorNumber;
-static int number_opens = 0;
+static atomic_t number_opens = ATOMIC_INIT(0);
 static struct class *charClass = NULL;
 static struct device *charDevice = NULL;
+static struct dentry *debug_dir = NULL;
 int max_msg_size; 
 int max_msg_n;
+unsigned long max_queued_bytes = DEFAULT_MAX_QUEUED_BYTES;
+int topic_hash_bits = BROKER_HASH_BITS;
+
+/*
+ * Registro (inscricao ou publicador) criado por um fd. A sessao e dona
+ * dele e o desfaz em dev_release(), inclusive quando o processo morre.
+ */
+typedef struct {
+    struct list_head node;
+    topic_s *topic;
+    process_s *process;     /* com referencia */
+    char list_type;
+} registration_s;
+
+/*
+ * Estado de cada fd aberto, em filep->private_data. Guarda o topico do
+ * ultimo /fetch (topicos so sao liberados quando o modulo sai) e a
+ * inscricao de 'pid' nele, com referencia, para que read() nao precise
+ * buscar nada. 'lock' protege topic/subscription/pid/registrations contra
+ * operacoes concorrentes no mesmo fd.
+ */
+typedef struct {
+    spinlock_t lock;
+    topic_s *topic;
+    process_s *subscription;
+    int pid;
+    int read_mode;      /* PUBSUB_READ_SINGLE ou PUBSUB_READ_BATCH */
+    struct list_head registrations;
+} session_s;
 
 static int  dev_open(struct inode *, struct file *);
 static int  dev_release(struct inode *, struct file *);
-static ssize_t  dev_read(struct file *, char *, size_t, loff_t *);
+static ssize_t  dev_read_iter(struct kiocb *, struct iov_iter *);
+static loff_t  dev_llseek(struct file *, loff_t, int);
 static ssize_t  dev_write(struct file *, const char *, size_t, loff_t *);
+static ssize_t  dev_write_iter(struct kiocb *, struct iov_iter *);
+static unsigned int dev_poll(struct file *, poll_table *);
+static int dev_mmap(struct file *, struct vm_area_struct *);
+static long dev_ioctl(struct file *, unsigned int, unsigned long);
 
 module_param(max_msg_size, int, 0); 
 module_param(max_msg_n, int, 0); 
-MODULE_PARM_DESC(max_msg_size, "Maximum message size in bytes.");
+MODULE_PARM_DESC(max_msg_size, "Maximum message size in bytes (default 64 KiB, up to 16 MiB).");
+MODULE_PARM_DESC(max_msg_n, "Maximum messages kept per subscriber mailbox.");
+module_param(max_queued_bytes, ulong, 0644);
+MODULE_PARM_DESC(max_queued_bytes, "Budget in bytes for all queued message payloads and mmap rings (0 = unlimited).");
+module_param(topic_hash_bits, int, 0);
+MODULE_PARM_DESC(topic_hash_bits, "Initial log2 size of the topic hash table (4-20); it doubles as topics are added.");
 
 static struct file_operations fops =
 {
+    .owner = THIS_MODULE,
     .open = dev_open,
-    .read = dev_read,
+    .read_iter = dev_read_iter,
+    .llseek = dev_llseek,
     .write = dev_write,
+    .write_iter = dev_write_iter,
+    .poll = dev_poll,
+    .mmap = dev_mmap,
+    .unlocked_ioctl = dev_ioctl,
     .release = dev_release,
 };
 
+/*
+ * debugfs: pubsub/state despeja o estado do broker sob demanda (antes era
+ * impresso no log a cada write()); pubsub/stats mostra os contadores e
+ * pubsub/latency os histogramas.
+ */
+static int state_show(struct seq_file *m, void *unused)
+{
+    show_topics(m);
+    return 0;
+}
+
+static int state_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, state_show, NULL);
+}
+
+static int stats_show(struct seq_file *m, void *unused)
+{
+    show_stats(m);
+    return 0;
+}
+
+static int stats_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, stats_show, NULL);
+}
+
+static int latency_show(struct seq_file *m, void *unused)
+{
+    show_latency(m);
+    return 0;
+}
+
+static int latency_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, latency_show, NULL);
+}
+
+static const struct file_operations state_fops = {
+    .owner = THIS_MODULE,
+    .open = state_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+static const struct file_operations stats_fops = {
+    .owner = THIS_MODULE,
+    .open = stats_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+static const struct file_operations latency_fops = {
+    .owner = THIS_MODULE,
+    .open = latency_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+static void pubsub_debugfs_init(void)
+{
+    /* Sem debugfs o driver funciona normalmente, so sem o dump */
+    debug_dir = debugfs_create_dir("pubsub", NULL);
+    if (IS_ERR_OR_NULL(debug_dir)) {
+        debug_dir = NULL;
+        return;
+    }
+    debugfs_create_file("state", 0400, debug_dir, NULL, &state_fops);
+    debugfs_create_file("stats", 0444, debug_dir, NULL, &stats_fops);
+    debugfs_create_file("latency", 0444, debug_dir, NULL, &latency_fops);
+}
+
 static int pubsub_init(void)
 {
+    int ret;
+
     printk(KERN_INFO "[PUBSUB] Initializing the LKM\n");
 
-    broker_init();
+    ret = broker_init();
+    if (ret) {
+        return ret;
+    }
+
+    if (max_msg_n <= 0) {
+        max_msg_n = DEFAULT_MAX_MSG_N;
+    }
+    if (max_msg_size <= 0) {
+        max_msg_size = DEFAULT_MAX_MSG_SIZE;
+    } else if (max_msg_size > MAX_MSG_SIZE_LIMIT) {
+        printk(KERN_WARNING "[PUBSUB] max_msg_size %d too large, using %d.\n", max_msg_size, MAX_MSG_SIZE_LIMIT);
+        max_msg_size = MAX_MSG_SIZE_LIMIT;
+    }
 
 	printk(KERN_INFO "[PUBSUB] Max size message: %d\n", max_msg_size);
 	printk(KERN_INFO "[PUBSUB] Max n message: %d\n", max_msg_n);
@@ -58,6 +205,7 @@ static int pubsub_init(void)
     majorNumber = register_chrdev(0, DEVICE_NAME, &fops);
     if (majorNumber < 0) {
         printk(KERN_ALERT "PubSub Driver failed to register a major number\n");
+        broker_exit();
         return majorNumber;
     }
     
@@ -66,6 +214,7 @@ static int pubsub_init(void)
     charClass = class_create(THIS_MODULE, CLASS_NAME);
     if (IS_ERR(charClass)) {
         unregister_chrdev(majorNumber, DEVICE_NAME);
+        broker_exit();
         printk(KERN_ALERT "[PUBSUB] failed to register device class\n");
         return PTR_ERR(charClass);
     }
@@ -76,131 +225,993 @@ static int pubsub_init(void)
     if (IS_ERR(charDevice)) {
         class_destroy(charClass);
         unregister_chrdev(majorNumber, DEVICE_NAME);
+        broker_exit();
         printk(KERN_ALERT "[PUBSUB] failed to create the device\n");
         return PTR_ERR(charDevice);
     }
     
     printk(KERN_INFO "[PUBSUB] device class created.\n");
+
+    pubsub_debugfs_init();
     return 0;
 }
 
 static void pubsub_exit(void)
 {
+    debugfs_remove_recursive(debug_dir);
     device_destroy(charClass, MKDEV(majorNumber, 0));
     class_unregister(charClass);
     class_destroy(charClass);
     unregister_chrdev(majorNumber, DEVICE_NAME);
+    broker_exit();
     printk(KERN_INFO "[PUBSUB] goodbye.\n");
 }
 
 static int dev_open(struct inode *inodep, struct file *filep)
 {
-    number_opens++;
-    printk(KERN_INFO "[PUBSUB] device has been opened %d time(s)\n", number_opens);
+    session_s *session;
+
+    session = kzalloc(sizeof(*session), GFP_KERNEL);
+    if (!session) {
+        return -ENOMEM;
+    }
+    spin_lock_init(&session->lock);
+    session->read_mode = PUBSUB_READ_SINGLE;
+    INIT_LIST_HEAD(&session->registrations);
+    filep->private_data = session;
+
+    printk(KERN_INFO "[PUBSUB] device has been opened %d time(s)\n", atomic_inc_return(&number_opens));
     printk("Process id: %d, name: %s\n", (int) task_pid_nr(current), current->comm);
-    filep->private_data = NULL;
     return 0;
 }
 
-static ssize_t dev_read(struct file *filep, char __user *buffer, size_t len, loff_t *offset)
+/*
+ * Troca a inscricao guardada na sessao; devolve a anterior para o chamador
+ * soltar fora do lock. Chamada com session->lock.
+ */
+static process_s *session_swap_subscription(session_s *session, process_s *subscription, int pid)
+{
+    process_s *old = session->subscription;
+
+    session->subscription = subscription;
+    session->pid = pid;
+    return old;
+}
+
+/*
+ * Inscricao do processo atual no topico do ultimo /fetch, com referencia
+ * (process_put), ou ERR_PTR. Normalmente vem da sessao; so busca na lista
+ * de inscritos na primeira vez, quando a inscricao guardada foi removida
+ * ou quando outro processo (ex.: apos fork) usa o mesmo fd.
+ */
+static process_s *fetched_subscription(session_s *session, topic_s **topic_out)
+{
+    topic_s *topic;
+    process_s *subscription, *stale;
+    int pid = task_pid_nr(current);
+
+    spin_lock(&session->lock);
+    topic = session->topic;
+    subscription = session->subscription;
+    if (subscription && session->pid == pid && !READ_ONCE(subscription->removed)) {
+        process_get(subscription);
+        spin_unlock(&session->lock);
+        goto out;
+    }
+    spin_unlock(&session->lock);
+
+    if (!topic) {
+        return ERR_PTR(-EINVAL);
+    }
+
+    subscription = topic_get_subscriber(topic, pid);
+    if (!subscription) {
+        return ERR_PTR(-EPERM);
+    }
+
+    /* Uma referencia para a sessao, outra para o chamador */
+    process_get(subscription);
+    spin_lock(&session->lock);
+    if (session->topic == topic) {
+        stale = session_swap_subscription(session, subscription, pid);
+    } else {
+        /* Um /fetch concorrente trocou o topico; nao guarda */
+        stale = subscription;
+    }
+    spin_unlock(&session->lock);
+    if (stale) {
+        process_put(stale);
+    }
+
+out:
+    if (topic_out) {
+        *topic_out = topic;
+    }
+    return subscription;
+}
+
+static int copy_from_user_chunked(char *dst, const char __user *src, size_t len)
+{
+    size_t chunk;
+
+    while (len > 0) {
+        chunk = min_t(size_t, len, COPY_CHUNK);
+        if (copy_from_user(dst, src, chunk)) {
+            return -EFAULT;
+        }
+        dst += chunk;
+        src += chunk;
+        len -= chunk;
+        if (len) {
+            cond_resched();
+        }
+    }
+    return 0;
+}
+
+static int copy_from_iter_chunked(char *dst, size_t len, struct iov_iter *from)
+{
+    size_t chunk;
+
+    while (len > 0) {
+        chunk = min_t(size_t, len, COPY_CHUNK);
+        if (copy_from_iter(dst, chunk, from) != chunk) {
+            return -EFAULT;
+        }
+        dst += chunk;
+        len -= chunk;
+        if (len) {
+            cond_resched();
+        }
+    }
+    return 0;
+}
+
+static int copy_to_iter_chunked(const char *src, size_t len, struct iov_iter *to)
+{
+    size_t chunk;
+
+    while (len > 0) {
+        chunk = min_t(size_t, len, COPY_CHUNK);
+        if (copy_to_iter(src, chunk, to) != chunk) {
+            return -EFAULT;
+        }
+        src += chunk;
+        len -= chunk;
+        if (len) {
+            cond_resched();
+        }
+    }
+    return 0;
+}
+
+/* Tamanho maximo de um comando de texto: nome, aspas e a mensagem */
+static size_t max_command_length(void)
+{
+    return MAX_COMMAND_LENGTH + max_msg_size;
+}
+
+/* Uma mensagem por read(), truncada no tamanho do buffer */
+static ssize_t read_single(topic_s *topic, process_s *subscription, struct iov_iter *to)
+{
+    payload_s *payload;
+    size_t len;
+    ssize_t ret;
+
+    payload = mailbox_pop(subscription);
+    if (!payload) {
+        return -EAGAIN;
+    }
+    if (IS_ERR(payload)) {
+        return PTR_ERR(payload);
+    }
+    topic_record_dequeue(topic, payload);
+
+    len = min(iov_iter_count(to), payload->size);
+    ret = copy_to_iter_chunked(payload->data, len, to) ? -EFAULT : len;
+
+    payload_put(payload);
+    return ret;
+}
+
+/*
+ * Quantas mensagens inteiras couberem, cada uma precedida pelo seu tamanho
+ * (__u32). Nunca trunca: se a primeira nao couber ela fica na mailbox e o
+ * read() falha com -EMSGSIZE; PUBSUB_IOC_NEXT_SIZE informa o necessario.
+ */
+static ssize_t read_batch(topic_s *topic, process_s *subscription, struct iov_iter *to)
+{
+    payload_s *payload;
+    size_t needed;
+    ssize_t total = 0;
+    __u32 frame_len;
+
+    while (iov_iter_count(to) > sizeof(frame_len)) {
+        payload = mailbox_pop_if_fits(subscription, iov_iter_count(to) - sizeof(frame_len), &needed);
+        if (!payload) {
+            if (needed && total == 0) {
+                return -EMSGSIZE;
+            }
+            break;
+        }
+        if (IS_ERR(payload)) {
+            /* Log sobrescrito: entrega o que ja copiou, o erro vem no proximo read() */
+            return total ? total : PTR_ERR(payload);
+        }
+        topic_record_dequeue(topic, payload);
+
+        frame_len = payload->size;
+        if (copy_to_iter(&frame_len, sizeof(frame_len), to) != sizeof(frame_len) ||
+            copy_to_iter_chunked(payload->data, payload->size, to)) {
+            payload_put(payload);
+            return total ? total : -EFAULT;
+        }
+        total += sizeof(frame_len) + payload->size;
+        payload_put(payload);
+    }
+
+    if (total == 0 && iov_iter_count(to) <= sizeof(frame_len) && mailbox_pending(subscription) > 0) {
+        return -EMSGSIZE;
+    }
+    return total ? total : -EAGAIN;
+}
+
+static ssize_t dev_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
-    char *topic_name;
+    struct file *filep = iocb->ki_filp;
+    session_s *session = filep->private_data;
     topic_s *topic;
-    process_s *subscription = NULL; 
-    process_s *iter; 
-    message_s *message_to_read;
-    pid_t current_pid = task_pid_nr(current);
+    process_s *subscription;
+    ssize_t ret;
     
-    if (filep->private_data == NULL) {
+    subscription = fetched_subscription(session, &topic);
+    if (subscription == ERR_PTR(-EINVAL)) {
         printk(KERN_INFO "[READ] No topic set. Use '/fetch <topic_name>' first.\n");
         return 0;
     }
-    topic_name = (char *)filep->private_data;
+    if (IS_ERR(subscription)) {
+        return PTR_ERR(subscription);
+    }
 
-    topic = find_topic(topic_name);
-    if (!topic) {
-        printk(KERN_WARNING "[READ] Fetched topic '%s' no longer exists.\n", topic_name);
-        return -ENOENT;
+    if (READ_ONCE(subscription->mmap)) {
+        /* Mailbox mapeada: as mensagens so chegam pelo anel compartilhado */
+        process_put(subscription);
+        return -EBUSY;
     }
 
-    list_for_each_entry(iter, &topic->process_subscribers, subscriber_node) {
-        if (iter->pid == current_pid) {
-            subscription = iter;
+    for (;;) {
+        if (session->read_mode == PUBSUB_READ_BATCH) {
+            ret = read_batch(topic, subscription, to);
+        } else {
+            ret = read_single(topic, subscription, to);
+        }
+        if (ret != -EAGAIN) {
+            break;
+        }
+
+        if (READ_ONCE(subscription->removed)) {
+            /* Inscricao removida enquanto esperava: fim de arquivo */
+            ret = 0;
+            break;
+        }
+        if ((filep->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT)) {
+            break;
+        }
+        if (wait_event_interruptible(*mailbox_waitq(subscription), mailbox_readable(subscription))) {
+            ret = -ERESTARTSYS;
             break;
         }
     }
 
-    if (!subscription) {
-        printk(KERN_WARNING "[READ] PID %d is not subscribed to topic '%s'.\n", current_pid, topic_name);
-        return -EPERM;
+    trace_pubsub_read(topic->name, subscription->pid, session->read_mode, ret);
+
+    process_put(subscription);
+    return ret;
+}
+
+/*
+ * Move a posicao de leitura de um inscrito em modo log (ver pubsub_uapi.h);
+ * f_pos acompanha a sequencia, so para informacao.
+ */
+static loff_t dev_llseek(struct file *filep, loff_t offset, int whence)
+{
+    session_s *session = filep->private_data;
+    process_s *subscription;
+    loff_t pos;
+
+    subscription = fetched_subscription(session, NULL);
+    if (IS_ERR(subscription)) {
+        return PTR_ERR(subscription);
+    }
+
+    pos = topic_log_seek(subscription, offset, whence);
+    if (pos >= 0) {
+        filep->f_pos = pos;
     }
 
-    if (list_empty(&subscription->message_queue)) {
-        printk(KERN_INFO "[READ] No messages for PID %d in topic '%s'.\n", current_pid, topic_name);
+    process_put(subscription);
+    return pos;
+}
+
+static unsigned int dev_poll(struct file *filep, poll_table *wait)
+{
+    session_s *session = filep->private_data;
+    topic_s *topic;
+    process_s *subscription;
+    unsigned int mask = POLLOUT | POLLWRNORM;
+
+    topic = READ_ONCE(session->topic);
+    if (!topic) {
+        return mask | POLLHUP;
+    }
+
+    /*
+     * A fila de poll fica no topico, que vive ate o modulo sair; a
+     * inscricao pode ser liberada por um /unsubscribe enquanto o fd
+     * continua registrado no epoll.
+     */
+    poll_wait(filep, &topic->poll_wait, wait);
+
+    subscription = fetched_subscription(session, NULL);
+    if (IS_ERR(subscription)) {
+        return mask | POLLHUP;
+    }
+
+    if (mailbox_pending(subscription) > 0) {
+        mask |= POLLIN | POLLRDNORM;
+    } else if (READ_ONCE(subscription->removed)) {
+        mask |= POLLHUP;
+    }
+
+    process_put(subscription);
+    return mask;
+}
+
+/*
+ * Mapeia a mailbox do processo para consumo sem syscall por mensagem.
+ * Exige /subscribe e /fetch do topico antes; o layout esta em pubsub_uapi.h.
+ */
+static int dev_mmap(struct file *filep, struct vm_area_struct *vma)
+{
+    session_s *session = filep->private_data;
+    topic_s *topic;
+    process_s *subscription;
+    int ret;
+
+    subscription = fetched_subscription(session, &topic);
+    if (IS_ERR(subscription)) {
+        return PTR_ERR(subscription);
+    }
+
+    ret = process_attach_mmap_ring(subscription);
+    if (!ret) {
+        ret = remap_vmalloc_range(vma, subscription->mmap->shared, vma->vm_pgoff);
+    }
+
+    if (ret) {
+        printk(KERN_WARNING "[MMAP] Failed to map mailbox for PID %d (%d).\n", subscription->pid, ret);
+    } else {
+        printk(KERN_INFO "[MMAP] Mailbox of PID %d in topic '%s' mapped.\n", subscription->pid, topic->name);
+    }
+
+    process_put(subscription);
+    return ret;
+}
+
+/* Registro desta sessao para o processo atual, ou NULL. Com session->lock. */
+static registration_s *session_find_registration(session_s *session, topic_s *topic, char list_type, int pid)
+{
+    registration_s *reg;
+
+    list_for_each_entry(reg, &session->registrations, node) {
+        if (reg->topic == topic && reg->list_type == list_type && reg->process->pid == pid) {
+            return reg;
+        }
+    }
+    return NULL;
+}
+
+static void registration_release(registration_s *reg)
+{
+    topic_release_process(reg->topic, reg->list_type, reg->process);
+    kfree(reg);
+}
+
+/*
+ * Registra o processo atual no topico em nome desta sessao. Repetir e
+ * barato (todo /publish de texto passa por aqui): so percorre a lista da
+ * sessao. Um registro removido por /unsubscribe e trocado por um novo.
+ */
+static int session_register(session_s *session, topic_s *topic, char list_type)
+{
+    registration_s *reg, *stale = NULL;
+    process_s *process;
+    int pid = task_pid_nr(current);
+
+    spin_lock(&session->lock);
+    reg = session_find_registration(session, topic, list_type, pid);
+    if (reg && !READ_ONCE(reg->process->removed)) {
+        spin_unlock(&session->lock);
         return 0;
     }
+    if (reg) {
+        list_del(&reg->node);
+        stale = reg;
+    }
+    spin_unlock(&session->lock);
 
-    message_to_read = list_first_entry(&subscription->message_queue, message_s, link);
-    
-    if (copy_to_user(buffer, message_to_read->message, min(len, message_to_read->size))) {
-        return -EFAULT;
+    if (stale) {
+        registration_release(stale);
     }
 
-    printk(KERN_INFO "[READ] Copied message for PID %d from topic '%s'.\n", current_pid, topic_name);
-    
-    list_del(&message_to_read->link);
-    kfree(message_to_read->message);
-    kfree(message_to_read);
-    subscription->msg_count--;
+    reg = kmalloc(sizeof(*reg), GFP_KERNEL);
+    if (!reg) {
+        return -ENOMEM;
+    }
+    process = topic_acquire_process(topic, list_type, pid);
+    if (IS_ERR(process)) {
+        kfree(reg);
+        return PTR_ERR(process);
+    }
+    reg->topic = topic;
+    reg->process = process;
+    reg->list_type = list_type;
 
-    return min(len, message_to_read->size);
+    spin_lock(&session->lock);
+    list_add_tail(&reg->node, &session->registrations);
+    spin_unlock(&session->lock);
+    return 0;
 }
 
-static int parse_command(char *input, char **cmd, char **arg1, char **arg2) {
-    *cmd = strsep(&input, " ");
-    *arg1 = strsep(&input, " ");
-    *arg2 = input;  // resto da linha (pode ser NULL)
-    return (*cmd != NULL);
+/* Solta o registro desta sessao apos um /unsubscribe explicito */
+static void session_forget(session_s *session, topic_s *topic, char list_type)
+{
+    registration_s *reg;
+
+    spin_lock(&session->lock);
+    reg = session_find_registration(session, topic, list_type, task_pid_nr(current));
+    if (reg) {
+        list_del(&reg->node);
+    }
+    spin_unlock(&session->lock);
+
+    if (reg) {
+        registration_release(reg);
+    }
 }
 
-static ssize_t dev_write(struct file *filep, const char __user *buffer, size_t len, loff_t *offset)
+/*
+ * Operacoes comuns aos comandos de texto e ao ioctl.
+ */
+static void fetch_topic(session_s *session, topic_s *topic)
 {
-    char *kernel_buffer;
-    char *cmd, *arg1, *arg2;
-    int ret = -EINVAL;
-    pid_t current_pid = task_pid_nr(current);
+    process_s *subscription, *old;
+    int pid = task_pid_nr(current);
 
-    if (len >= MAX_COMMAND_LENGTH || len <= 1) {
-        printk(KERN_INFO "[PUBSUB] Command too long or too short.\n");
+    /* Pode ainda nao haver inscricao; nesse caso o read() resolve depois */
+    subscription = topic_get_subscriber(topic, pid);
+
+    spin_lock(&session->lock);
+    session->topic = topic;
+    old = session_swap_subscription(session, subscription, pid);
+    spin_unlock(&session->lock);
+    if (old) {
+        process_put(old);
+    }
+}
+
+static int do_fetch(struct file *filep, const char *name)
+{
+    topic_s *topic = find_topic(name);
+
+    if (!topic) {
+        printk(KERN_INFO "[PUBSUB] Topic '%s' not found for fetching.\n", name);
+        return -ENOENT;
+    }
+
+    fetch_topic(filep->private_data, topic);
+    printk(KERN_INFO "[PUBSUB] Topic '%s' set for read operations.\n", name);
+    return 0;
+}
+
+static void unsubscribe_topic(session_s *session, topic_s *topic)
+{
+    topic_remove_subscriber(topic, task_pid_nr(current));
+    session_forget(session, topic, 's');
+}
+
+static int do_unsubscribe(struct file *filep, const char *name)
+{
+    topic_s *topic = find_topic(name);
+
+    if (!topic) {
+        printk(KERN_INFO "[PUBSUB] Topic %s not found for unsubscribing.\n", name);
+        return -ENOENT;
+    }
+    unsubscribe_topic(filep->private_data, topic);
+    return 0;
+}
+
+static int copy_topic_name(char *name, __u64 user_name, __u32 name_len)
+{
+    if (name_len == 0) {
+        return -EINVAL;
+    }
+    if (name_len > PUBSUB_TOPIC_NAME_MAX) {
+        return -ENAMETOOLONG;
+    }
+    if (copy_from_user(name, u64_to_user_ptr(user_name), name_len)) {
+        return -EFAULT;
+    }
+    name[name_len] = '\0';
+    if (strlen(name) != name_len) {
         return -EINVAL;
     }
+    return 0;
+}
 
-    kernel_buffer = kmalloc(len + 1, GFP_KERNEL);
-    if (!kernel_buffer) {
-        printk(KERN_ALERT "[PUBSUB] Failed to allocate kernel buffer.\n");
+/*
+ * Resolve o topico de um argumento de ioctl. Com name_len == 0, 'name'
+ * carrega o handle devolvido pelo registro e nao ha nome a copiar nem
+ * hash a calcular. Com 'create', um nome ainda desconhecido cria o topico.
+ * 'last' (pode ser NULL) e o topico da entrada anterior de um lote: se o
+ * argumento for o mesmo, ele e reaproveitado sem busca.
+ */
+static int resolve_topic_arg(__u64 user_name, __u32 name_len, bool create, topic_s *last, topic_s **topic_out)
+{
+    char name[PUBSUB_TOPIC_NAME_MAX + 1];
+    topic_s *topic;
+    int ret;
+
+    if (name_len == 0) {
+        if (last && user_name == last->id) {
+            topic = last;
+        } else {
+            topic = user_name <= U32_MAX ? find_topic_by_handle(user_name) : NULL;
+        }
+        if (!topic) {
+            return -ENOENT;
+        }
+    } else {
+        ret = copy_topic_name(name, user_name, name_len);
+        if (ret) {
+            return ret;
+        }
+        if (last && strcmp(name, last->name) == 0) {
+            topic = last;
+        } else {
+            topic = create ? find_or_create_topic(name) : find_topic(name);
+        }
+        if (IS_ERR(topic)) {
+            return PTR_ERR(topic);
+        }
+        if (!topic) {
+            return -ENOENT;
+        }
+    }
+
+    *topic_out = topic;
+    return 0;
+}
+
+/*
+ * Agrupa publicacoes consecutivas no mesmo topico (writev e ioctl em lote)
+ * para que a busca do topico, o registro do publicador e o fan-out
+ * acontecam uma vez por grupo, nao uma vez por mensagem.
+ */
+#define PUBLISH_BATCH_MAX 32
+
+typedef struct {
+    session_s *session;     /* dona dos registros de publicador */
+    topic_s *topic;
+    unsigned int count;
+    payload_s *payloads[PUBLISH_BATCH_MAX];
+    /*
+     * Progresso para o chamador: cada entrada leva a marca 'tag' vigente
+     * quando entrou (indice + 1 no ioctl, fim do segmento no writev) e
+     * 'done' fica com a marca da ultima que foi de fato entregue.
+     */
+    u64 tag;
+    u64 tags[PUBLISH_BATCH_MAX];
+    u64 done;
+} publish_batch_s;
+
+/* Erro se alguma entrada nao foi entregue; ela e as seguintes sao descartadas */
+static int batch_flush(publish_batch_s *batch)
+{
+    unsigned int i;
+    int ret = 0;
+
+    if (batch->count > 0) {
+        ret = topic_publish_payloads(batch->topic, batch->payloads, batch->count);
+        if (ret > 0) {
+            batch->done = batch->tags[ret - 1];
+            /* Entrega parcial: o prazo de BLOCK acabou no meio do lote */
+            ret = ret < batch->count ? -EAGAIN : 0;
+        }
+        for (i = 0; i < batch->count; i++) {
+            payload_put(batch->payloads[i]);
+        }
+        batch->count = 0;
+    }
+    return ret;
+}
+
+/* Fica com a referencia do payload, inclusive em caso de erro */
+static int batch_add(publish_batch_s *batch, topic_s *topic, payload_s *payload)
+{
+    int ret = 0;
+
+    if (batch->topic != topic) {
+        ret = batch_flush(batch);
+        if (ret == 0) {
+            ret = session_register(batch->session, topic, 'p');
+        }
+        if (ret) {
+            batch->topic = NULL;
+            payload_put(payload);
+            return ret;
+        }
+        batch->topic = topic;
+    } else if (batch->count == PUBLISH_BATCH_MAX) {
+        ret = batch_flush(batch);
+        if (ret) {
+            payload_put(payload);
+            return ret;
+        }
+    }
+
+    batch->tags[batch->count] = batch->tag;
+    batch->payloads[batch->count++] = payload;
+    return 0;
+}
+
+/* Topico de um /publish em lote: o do grupo atual, sem busca, se o nome e o mesmo */
+static topic_s *batch_topic(publish_batch_s *batch, const char *name)
+{
+    if (batch->topic && strcmp(batch->topic->name, name) == 0) {
+        return batch->topic;
+    }
+    return find_or_create_topic(name);
+}
+
+/*
+ * Le uma entrada de publish do usuario: topico (por nome ou handle) em
+ * '*topic_out' e payload ja copiado em '*payload_out'. 'last' como em
+ * resolve_topic_arg().
+ */
+static int copy_publish_arg(const struct pubsub_publish_arg *arg, topic_s *last,
+                            topic_s **topic_out, payload_s **payload_out)
+{
+    payload_s *payload;
+    int ret;
+
+    if (arg->payload_len == 0 || arg->payload_len > max_msg_size) {
+        return -EMSGSIZE;
+    }
+
+    ret = resolve_topic_arg(arg->name, arg->name_len, true, last, topic_out);
+    if (ret) {
+        return ret;
+    }
+
+    /* Copia direto do usuario para o payload compartilhado */
+    payload = payload_alloc(arg->payload_len);
+    if (!payload) {
+        topic_note_alloc_failure(*topic_out);
         return -ENOMEM;
     }
+    if (copy_from_user_chunked(payload->data, u64_to_user_ptr(arg->payload), arg->payload_len)) {
+        payload_put(payload);
+        return -EFAULT;
+    }
+
+    *payload_out = payload;
+    return 0;
+}
+
+/* Devolve o handle do topico, para as proximas publicacoes */
+static long ioctl_publish(session_s *session, struct pubsub_publish_arg __user *uarg)
+{
+    struct pubsub_publish_arg arg;
+    topic_s *topic;
+    payload_s *payload;
+    int ret;
 
-    if (copy_from_user(kernel_buffer, buffer, len)) {
-        kfree(kernel_buffer);
+    if (copy_from_user(&arg, uarg, sizeof(arg))) {
         return -EFAULT;
     }
-    kernel_buffer[len] = '\0';
 
-    printk(KERN_INFO "[PUBSUB] Received command '%s'\n", kernel_buffer);
+    ret = copy_publish_arg(&arg, NULL, &topic, &payload);
+    if (ret) {
+        return ret;
+    }
+
+    ret = session_register(session, topic, 'p');
+    if (ret == 0) {
+        ret = topic_publish_payload(topic, payload);
+    }
+    payload_put(payload);
+    return ret ? ret : topic->id;
+}
+
+static long ioctl_publish_batch(session_s *session, struct pubsub_publish_batch_arg __user *uarg)
+{
+    struct pubsub_publish_batch_arg arg;
+    struct pubsub_publish_arg entry;
+    struct pubsub_publish_arg __user *entries;
+    publish_batch_s *batch;
+    topic_s *topic;
+    payload_s *payload;
+    int ret = 0, flush_ret;
+    __u32 i, published;
+
+    if (copy_from_user(&arg, uarg, sizeof(arg))) {
+        return -EFAULT;
+    }
+    entries = u64_to_user_ptr(arg.entries);
+
+    batch = kzalloc(sizeof(*batch), GFP_KERNEL);
+    if (!batch) {
+        return -ENOMEM;
+    }
+    batch->session = session;
+
+    for (i = 0; i < arg.count; i++) {
+        if (copy_from_user(&entry, &entries[i], sizeof(entry))) {
+            ret = -EFAULT;
+            break;
+        }
+        /* Entradas seguidas no mesmo topico so o buscam na primeira */
+        ret = copy_publish_arg(&entry, batch->topic, &topic, &payload);
+        if (ret == 0) {
+            batch->tag = i + 1;
+            ret = batch_add(batch, topic, payload);
+        }
+        if (ret) {
+            break;
+        }
+    }
+
+    flush_ret = batch_flush(batch);
+    if (ret == 0) {
+        ret = flush_ret;
+    }
+    /* Entradas em ordem: a primeira nao entregue vem logo apos a ultima entregue */
+    published = batch->done;
+    kfree(batch);
+
+    if (put_user(published, &uarg->published)) {
+        return -EFAULT;
+    }
+    return ret;
+}
+
+static long ioctl_set_config(struct pubsub_topic_config __user *uarg)
+{
+    struct pubsub_topic_config config;
+    topic_s *topic;
+    int ret;
+
+    if (copy_from_user(&config, uarg, sizeof(config))) {
+        return -EFAULT;
+    }
+
+    ret = resolve_topic_arg(config.name, config.name_len, true, NULL, &topic);
+    if (ret) {
+        return ret;
+    }
+    return topic_configure(topic, &config);
+}
+
+static long ioctl_next_size(struct file *filep, __u32 __user *size_out)
+{
+    session_s *session = filep->private_data;
+    process_s *subscription;
+    __u32 size;
+
+    subscription = fetched_subscription(session, NULL);
+    if (IS_ERR(subscription)) {
+        return PTR_ERR(subscription);
+    }
+
+    size = mailbox_next_size(subscription);
+    if (size && session->read_mode == PUBSUB_READ_BATCH) {
+        size += sizeof(__u32);
+    }
+    process_put(subscription);
+
+    return put_user(size, size_out);
+}
+
+static long ioctl_log_status(struct file *filep, struct pubsub_log_status __user *status_out)
+{
+    session_s *session = filep->private_data;
+    struct pubsub_log_status status;
+    process_s *subscription;
+    int ret;
+
+    subscription = fetched_subscription(session, NULL);
+    if (IS_ERR(subscription)) {
+        return PTR_ERR(subscription);
+    }
+
+    ret = topic_log_status(subscription, &status);
+    process_put(subscription);
+    if (ret) {
+        return ret;
+    }
+
+    return copy_to_user(status_out, &status, sizeof(status)) ? -EFAULT : 0;
+}
+
+static long dev_ioctl(struct file *filep, unsigned int cmd, unsigned long arg)
+{
+    session_s *session = filep->private_data;
+    struct pubsub_topic_arg topic_arg;
+    topic_s *topic;
+    __u32 mode;
+    int ret;
+
+    switch (cmd) {
+    case PUBSUB_IOC_SET_READ_MODE:
+        if (get_user(mode, (__u32 __user *)arg)) {
+            return -EFAULT;
+        }
+        if (mode != PUBSUB_READ_SINGLE && mode != PUBSUB_READ_BATCH) {
+            return -EINVAL;
+        }
+        session->read_mode = mode;
+        return 0;
+    case PUBSUB_IOC_NEXT_SIZE:
+        return ioctl_next_size(filep, (__u32 __user *)arg);
+    case PUBSUB_IOC_SET_CONFIG:
+        return ioctl_set_config((struct pubsub_topic_config __user *)arg);
+    case PUBSUB_IOC_LOG_STATUS:
+        return ioctl_log_status(filep, (struct pubsub_log_status __user *)arg);
+    }
+
+    if (cmd == PUBSUB_IOC_PUBLISH) {
+        return ioctl_publish(session, (struct pubsub_publish_arg __user *)arg);
+    }
+    if (cmd == PUBSUB_IOC_PUBLISH_BATCH) {
+        return ioctl_publish_batch(session, (struct pubsub_publish_batch_arg __user *)arg);
+    }
+
+    if (cmd != PUBSUB_IOC_SUBSCRIBE && cmd != PUBSUB_IOC_UNSUBSCRIBE && cmd != PUBSUB_IOC_FETCH &&
+        cmd != PUBSUB_IOC_FLUSH) {
+        return -ENOTTY;
+    }
+
+    if (copy_from_user(&topic_arg, (void __user *)arg, sizeof(topic_arg))) {
+        return -EFAULT;
+    }
+    ret = resolve_topic_arg(topic_arg.name, topic_arg.name_len, cmd == PUBSUB_IOC_SUBSCRIBE, NULL, &topic);
+    if (ret) {
+        return ret;
+    }
+
+    switch (cmd) {
+    case PUBSUB_IOC_SUBSCRIBE:
+        /* Devolve o handle do topico */
+        ret = session_register(session, topic, 's');
+        return ret ? ret : topic->id;
+    case PUBSUB_IOC_UNSUBSCRIBE:
+        unsubscribe_topic(session, topic);
+        return 0;
+    case PUBSUB_IOC_FLUSH:
+        return topic_flush(topic);
+    default:
+        fetch_topic(session, topic);
+        return 0;
+    }
+}
+
+/*
+ * "/config <topico> <chave> <valor>", o equivalente em texto de
+ * PUBSUB_IOC_SET_CONFIG.
+ */
+static int do_config(const char *name, char *args)
+{
+    struct pubsub_topic_config config = { 0 };
+    char *key = strsep(&args, " ");
+    topic_s *topic;
+    int ret;
+
+    if (!key || !args) {
+        return -EINVAL;
+    }
+
+    if (strcmp(key, "policy") == 0) {
+        config.set = PUBSUB_CONFIG_POLICY;
+        if (strcmp(args, "overwrite") == 0) {
+            config.policy = PUBSUB_POLICY_OVERWRITE;
+        } else if (strcmp(args, "drop") == 0) {
+            config.policy = PUBSUB_POLICY_DROP_NEWEST;
+        } else if (strcmp(args, "block") == 0) {
+            config.policy = PUBSUB_POLICY_BLOCK;
+        } else {
+            return -EINVAL;
+        }
+    } else if (strcmp(key, "async") == 0) {
+        config.set = PUBSUB_CONFIG_ASYNC;
+        if (strcmp(args, "on") == 0) {
+            config.async = 1;
+        } else if (strcmp(args, "off") == 0) {
+            config.async = 0;
+        } else {
+            return -EINVAL;
+        }
+    } else if (strcmp(key, "retain") == 0) {
+        config.set = PUBSUB_CONFIG_RETAIN;
+        if (strcmp(args, "on") == 0) {
+            config.retain = 1;
+        } else if (strcmp(args, "off") == 0) {
+            config.retain = 0;
+        } else {
+            return -EINVAL;
+        }
+    } else if (strcmp(key, "log") == 0) {
+        config.set = PUBSUB_CONFIG_LOG;
+        ret = kstrtouint(args, 10, &config.log_entries);
+        if (ret) {
+            return ret;
+        }
+    } else if (strcmp(key, "block_timeout") == 0) {
+        config.set = PUBSUB_CONFIG_BLOCK_TIMEOUT;
+        ret = kstrtouint(args, 10, &config.block_timeout_ms);
+        if (ret) {
+            return ret;
+        }
+    } else {
+        return -EINVAL;
+    }
+
+    topic = find_or_create_topic(name);
+    if (IS_ERR(topic)) {
+        return PTR_ERR(topic);
+    }
+    return topic_configure(topic, &config);
+}
+
+static int parse_command(char *input, char **cmd, char **arg1, char **arg2) {
+    *cmd = strsep(&input, " ");
+    *arg1 = strsep(&input, " ");
+    *arg2 = input;  // resto da linha (pode ser NULL)
+    return (*cmd != NULL);
+}
+
+/*
+ * Executa um comando de texto ja copiado para o kernel. Com 'batch', os
+ * /publish sao acumulados e entregues em grupo; qualquer outro comando
+ * descarrega o lote antes, para manter a ordem.
+ */
+static int run_command(struct file *filep, char *kernel_buffer, size_t len, publish_batch_s *batch)
+{
+    char *cmd, *arg1, *arg2;
+    int ret = -EINVAL;
 
     if (!parse_command(kernel_buffer, &cmd, &arg1, &arg2)) {
         printk(KERN_INFO "[PUBSUB] Invalid command format.\n");
-        kfree(kernel_buffer);
         return -EINVAL;
     }
 
+    if (batch && strcmp(cmd, "/publish") != 0) {
+        ret = batch_flush(batch);
+        if (ret) {
+            return ret;
+        }
+        ret = -EINVAL;
+    }
+
     /* ==================== SUBSCRIBE ==================== */
     if (strcmp(cmd, "/subscribe") == 0) {
         if (!arg1) {
             printk(KERN_INFO "[PUBSUB] Missing topic name for /subscribe.\n");
         } else {
-            ret = register_process_to_topic(arg1, 's', current_pid);
+            topic_s *topic = find_or_create_topic(arg1);
+
+            ret = IS_ERR(topic) ? PTR_ERR(topic) : session_register(filep->private_data, topic, 's');
             if (ret == 0)
                 ret = len;
         }
@@ -210,14 +1221,8 @@ static ssize_t dev_write(struct file *filep, const char __user *buffer, size_t l
     else if (strcmp(cmd, "/unsubscribe") == 0) {
         if (!arg1) {
             printk(KERN_INFO "[PUBSUB] Missing topic name for /unsubscribe.\n");
-        } else {
-            topic_s *topic = find_topic(arg1);
-            if (topic) {
-                topic_remove_subscriber(topic, current_pid);
-                ret = len;
-            } else {
-                printk(KERN_INFO "[PUBSUB] Topic %s not found for unsubscribing.\n", arg1);
-            }
+        } else if (do_unsubscribe(filep, arg1) == 0) {
+            ret = len;
         }
     }
 
@@ -226,19 +1231,37 @@ static ssize_t dev_write(struct file *filep, const char __user *buffer, size_t l
         if (!arg1) {
             printk(KERN_INFO "[PUBSUB] Missing topic name for /fetch.\n");
         } else {
-            topic_s *topic = find_topic(arg1);
-            if (topic) {
-                char *topic_ptr = kmalloc(strlen(arg1) + 1, GFP_KERNEL);
-                if (topic_ptr) {
-                    strcpy(topic_ptr, arg1);
-                    filep->private_data = topic_ptr;
-                    printk(KERN_INFO "[PUBSUB] Topic '%s' set for read operations.\n", arg1);
-                    ret = len;
-                } else {
-                    ret = -ENOMEM;
-                }
-            } else {
-                printk(KERN_INFO "[PUBSUB] Topic '%s' not found for fetching.\n", arg1);
+            ret = do_fetch(filep, arg1);
+            if (ret == 0) {
+                ret = len;
+            } else if (ret == -ENOENT) {
+                ret = -EINVAL;
+            }
+        }
+    }
+
+    /* ==================== FLUSH ==================== */
+    else if (strcmp(cmd, "/flush") == 0) {
+        topic_s *topic = arg1 ? find_topic(arg1) : NULL;
+
+        if (!topic) {
+            printk(KERN_INFO "[PUBSUB] Missing or unknown topic for /flush.\n");
+        } else {
+            ret = topic_flush(topic);
+            if (ret == 0) {
+                ret = len;
+            }
+        }
+    }
+
+    /* ==================== CONFIG ==================== */
+    else if (strcmp(cmd, "/config") == 0) {
+        if (!arg1 || !arg2) {
+            printk(KERN_INFO "[PUBSUB] Usage: /config <topic> <policy|block_timeout|async|log|retain> <value>.\n");
+        } else {
+            ret = do_config(arg1, arg2);
+            if (ret == 0) {
+                ret = len;
             }
         }
     }
@@ -248,25 +1271,46 @@ static ssize_t dev_write(struct file *filep, const char __user *buffer, size_t l
         if (!arg1 || !arg2) {
             printk(KERN_INFO "[PUBSUB] Missing topic or message for /publish.\n");
         } else {
+            topic_s *topic = NULL;
+            char *end_of_message;
             char *message_content = strchr(arg2, '"');
             if (message_content) {
                 message_content++;
-                char *end_of_message = strrchr(message_content, '"');
+                end_of_message = strrchr(message_content, '"');
                 if (end_of_message)
                     *end_of_message = '\0';
 
-                ret = register_process_to_topic(arg1, 'p', current_pid);
-                if (ret == 0) {
-                    topic_s *topic = find_topic(arg1);
-                    if (topic) {
-                        topic_publish_message(topic, message_content, (short)strlen(message_content));
-                        ret = len;
+                if (strlen(message_content) + 1 > max_msg_size) {
+                    printk(KERN_INFO "[PUBSUB] Message for topic %s exceeds max_msg_size (%d).\n", arg1, max_msg_size);
+                    return -EMSGSIZE;
+                }
+
+                if (batch) {
+                    payload_s *payload;
+
+                    topic = batch_topic(batch, arg1);
+                    if (IS_ERR(topic)) {
+                        return PTR_ERR(topic);
+                    }
+                    payload = payload_create(message_content, strlen(message_content) + 1);
+                    if (payload) {
+                        ret = batch_add(batch, topic, payload);
                     } else {
-                        printk(KERN_ERR "[PUBSUB] Logic error: topic not found after successful registration.\n");
-                        ret = -EINVAL;
+                        topic_note_alloc_failure(topic);
+                        ret = -ENOMEM;
                     }
+                    if (ret == 0)
+                        ret = len;
                 } else {
-                    printk(KERN_INFO "[PUBSUB] Failed to register process for publishing to topic %s.\n", arg1);
+                    topic = find_or_create_topic(arg1);
+                    ret = IS_ERR(topic) ? PTR_ERR(topic) : session_register(filep->private_data, topic, 'p');
+                    if (ret == 0) {
+                        ret = topic_publish_message(topic, message_content, strlen(message_content) + 1);
+                        if (ret == 0)
+                            ret = len;
+                    } else {
+                        printk(KERN_INFO "[PUBSUB] Failed to register process for publishing to topic %s.\n", arg1);
+                    }
                 }
             } else {
                 printk(KERN_INFO "[PUBSUB] Publish message must be enclosed in quotes.\n");
@@ -279,19 +1323,125 @@ static ssize_t dev_write(struct file *filep, const char __user *buffer, size_t l
         printk(KERN_INFO "[PUBSUB] Unknown command: %s\n", cmd);
     }
 
-    show_topics();
+    return ret;
+}
+
+static ssize_t dev_write(struct file *filep, const char __user *buffer, size_t len, loff_t *offset)
+{
+    char *kernel_buffer;
+    int ret;
+
+    if (len >= max_command_length() || len <= 1) {
+        printk(KERN_INFO "[PUBSUB] Command too long or too short.\n");
+        return -EINVAL;
+    }
+
+    kernel_buffer = kvmalloc(len + 1, GFP_KERNEL);
+    if (!kernel_buffer) {
+        printk(KERN_ALERT "[PUBSUB] Failed to allocate kernel buffer.\n");
+        return -ENOMEM;
+    }
+
+    if (copy_from_user_chunked(kernel_buffer, buffer, len)) {
+        kvfree(kernel_buffer);
+        return -EFAULT;
+    }
+    kernel_buffer[len] = '\0';
+
+    ret = run_command(filep, kernel_buffer, len, NULL);
 
-    kfree(kernel_buffer);
+    kvfree(kernel_buffer);
     return (ret > 0) ? len : ret;
 }
 
+/*
+ * writev(): cada segmento e um comando de texto, como num write(). Os
+ * /publish consecutivos no mesmo topico saem em lote.
+ */
+static ssize_t dev_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    publish_batch_s *batch;
+    char *kernel_buffer = NULL;
+    size_t buffer_size = 0;
+    struct iovec segment;
+    ssize_t written = 0, done;
+    int ret = 0, flush_ret;
+
+    if (!iter_is_iovec(from)) {
+        return -EINVAL;
+    }
+
+    batch = kzalloc(sizeof(*batch), GFP_KERNEL);
+    if (!batch) {
+        return -ENOMEM;
+    }
+    batch->session = iocb->ki_filp->private_data;
+
+    while (iov_iter_count(from) > 0) {
+        segment = iov_iter_iovec(from);
+        if (segment.iov_len >= max_command_length() || segment.iov_len <= 1) {
+            printk(KERN_INFO "[PUBSUB] Command too long or too short.\n");
+            ret = -EINVAL;
+            break;
+        }
+        /* O buffer cresce sob demanda: comandos curtos nao pagam pelo maior */
+        if (segment.iov_len + 1 > buffer_size) {
+            kvfree(kernel_buffer);
+            buffer_size = max_t(size_t, segment.iov_len + 1, MAX_COMMAND_LENGTH);
+            kernel_buffer = kvmalloc(buffer_size, GFP_KERNEL);
+            if (!kernel_buffer) {
+                ret = -ENOMEM;
+                break;
+            }
+        }
+        if (copy_from_iter_chunked(kernel_buffer, segment.iov_len, from)) {
+            ret = -EFAULT;
+            break;
+        }
+        kernel_buffer[segment.iov_len] = '\0';
+
+        batch->tag = written + segment.iov_len;
+        ret = run_command(iocb->ki_filp, kernel_buffer, segment.iov_len, batch);
+        if (ret < 0) {
+            break;
+        }
+        written += segment.iov_len;
+        if (batch->count == 0) {
+            /* Comando executado e nenhum /publish pendente antes dele */
+            batch->done = written;
+        }
+    }
+
+    flush_ret = batch_flush(batch);
+    if (ret >= 0 && flush_ret < 0) {
+        ret = flush_ret;
+    }
+    /* So conta os segmentos concluidos; o erro aparece no proximo writev */
+    done = batch->done;
+
+    kvfree(kernel_buffer);
+    kfree(batch);
+    return done > 0 ? done : ret;
+}
+
+/*
+ * Ultimo close do fd (tambem na saida do processo): desfaz as inscricoes
+ * e registros de publicador que ele criou.
+ */
 static int dev_release(struct inode *inodep, struct file *filep)
 {
-    // If there's any private data left, free it on close
-    if (filep->private_data != NULL) {
-        kfree(filep->private_data);
-        filep->private_data = NULL;
+    session_s *session = filep->private_data;
+    registration_s *reg, *next;
+
+    if (session->subscription) {
+        process_put(session->subscription);
+    }
+    list_for_each_entry_safe(reg, next, &session->registrations, node) {
+        list_del(&reg->node);
+        registration_release(reg);
     }
+    kfree(session);
+    filep->private_data = NULL;
 
     printk(KERN_INFO "[PUBSUB] device successfully closed\n");
     return 0;
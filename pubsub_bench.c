@@ -0,0 +1,537 @@
+/*
+ * Gerador de carga do pubsub_driver: N publicadores e M inscritos, cada um
+ * um processo, sobre T topicos. Cada mensagem leva um cabecalho com o
+ * publicador, a sequencia e o instante do envio (CLOCK_MONOTONIC, comum a
+ * todos os processos); os inscritos medem a latencia fim a fim e contam as
+ * lacunas na sequencia. O resultado sai em JSON numa unica linha.
+ *
+ *   pubsub_bench -p 4 -s 16 -t 4 -b 256 -r 10000 -d 10 -P drop
+ *
+ * Os contadores de sobrescrita e descarte do driver vem de
+ * /sys/kernel/debug/pubsub/stats, quando o debugfs esta montado.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+
+#include "pubsub_uapi.h"
+
+#define DEVICE_PATH "/dev/pubsub_driver"
+#define STATS_PATH "/sys/kernel/debug/pubsub/stats"
+#define TOPIC_PREFIX "bench/"
+#define MAX_PUBLISHERS 1024
+
+/*
+ * Histograma log-linear: 64 faixas por potencia de 2, erro < 1,6%.
+ * Indice = (expoente << 6) | 6 bits seguintes ao bit mais alto.
+ */
+#define HIST_SUB_BITS 6
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (64 * HIST_SUB)
+
+struct msg_header {
+    __u32 publisher;
+    __u32 reserved;
+    __u64 seq;
+    __u64 send_ns;
+};
+
+/* Um por processo filho, em memoria compartilhada com o pai */
+struct worker_result {
+    unsigned long long published;
+    unsigned long long publish_errors;
+    unsigned long long received;
+    unsigned long long bytes;
+    unsigned long long lost;
+    unsigned long long max_ns;
+    unsigned long long hist[HIST_BUCKETS];
+};
+
+struct options {
+    int publishers;
+    int subscribers;
+    int topics;
+    int payload_size;
+    long rate;          /* mensagens/s por publicador, 0 = sem limite */
+    int duration;
+    int policy;         /* -1: nao configura */
+};
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void on_stop(int sig)
+{
+    (void)sig;
+    stop_requested = 1;
+}
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int hist_index(unsigned long long v)
+{
+    int exp;
+
+    if (v < HIST_SUB) {
+        return (int)v;
+    }
+    exp = 63 - __builtin_clzll(v);
+    return ((exp - HIST_SUB_BITS + 1) << HIST_SUB_BITS) | (int)((v >> (exp - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* Limite inferior da faixa 'index' */
+static unsigned long long hist_value(int index)
+{
+    int exp = index >> HIST_SUB_BITS;
+    unsigned long long sub = index & (HIST_SUB - 1);
+
+    if (exp == 0) {
+        return sub;
+    }
+    return (HIST_SUB | sub) << (exp - 1);
+}
+
+static unsigned long long hist_percentile(const unsigned long long *hist, unsigned long long total, double pct)
+{
+    unsigned long long rank = (unsigned long long)(total * pct / 100.0);
+    unsigned long long seen = 0;
+    int i;
+
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist[i];
+        if (seen > rank) {
+            return hist_value(i);
+        }
+    }
+    return 0;
+}
+
+static void topic_name(char *name, size_t size, int topic)
+{
+    snprintf(name, size, TOPIC_PREFIX "%d", topic);
+}
+
+static int topic_ioctl(int fd, unsigned long cmd, const char *name)
+{
+    struct pubsub_topic_arg arg = { 0 };
+
+    arg.name = (__u64)(unsigned long)name;
+    arg.name_len = strlen(name);
+    return ioctl(fd, cmd, &arg);
+}
+
+static int configure_topics(const struct options *opt)
+{
+    struct pubsub_topic_config config;
+    char name[64];
+    int fd, t;
+
+    if (opt->policy < 0) {
+        return 0;
+    }
+    fd = open(DEVICE_PATH, O_RDWR);
+    if (fd < 0) {
+        perror("open");
+        return -1;
+    }
+    for (t = 0; t < opt->topics; t++) {
+        memset(&config, 0, sizeof(config));
+        topic_name(name, sizeof(name), t);
+        config.name = (__u64)(unsigned long)name;
+        config.name_len = strlen(name);
+        config.set = PUBSUB_CONFIG_POLICY;
+        config.policy = opt->policy;
+        if (ioctl(fd, PUBSUB_IOC_SET_CONFIG, &config) < 0) {
+            perror("PUBSUB_IOC_SET_CONFIG");
+            close(fd);
+            return -1;
+        }
+    }
+    close(fd);
+    return 0;
+}
+
+/*
+ * Inscrito: um topico (id % topicos), leitura em lote sem bloqueio e
+ * poll() ate o pai mandar SIGUSR1.
+ */
+static int run_subscriber(int id, const struct options *opt, struct worker_result *res, int ready_fd)
+{
+    unsigned long long *last_seq;
+    struct msg_header header;
+    struct pollfd pfd;
+    char name[64];
+    char *buffer;
+    size_t buffer_size;
+    __u32 mode = PUBSUB_READ_BATCH;
+    __u32 frame_len;
+    ssize_t len, off;
+    int fd;
+
+    buffer_size = 64 * (opt->payload_size + sizeof(__u32));
+    if (buffer_size < 65536) {
+        buffer_size = 65536;
+    }
+    buffer = malloc(buffer_size);
+    last_seq = calloc(opt->publishers, sizeof(*last_seq));
+    if (!buffer || !last_seq) {
+        return 1;
+    }
+
+    fd = open(DEVICE_PATH, O_RDWR | O_NONBLOCK);
+    if (fd < 0) {
+        perror("open");
+        return 1;
+    }
+    topic_name(name, sizeof(name), id % opt->topics);
+    if (topic_ioctl(fd, PUBSUB_IOC_SUBSCRIBE, name) < 0 ||
+        topic_ioctl(fd, PUBSUB_IOC_FETCH, name) < 0 ||
+        ioctl(fd, PUBSUB_IOC_SET_READ_MODE, &mode) < 0) {
+        perror("subscribe");
+        return 1;
+    }
+    if (write(ready_fd, "r", 1) != 1) {
+        return 1;
+    }
+    close(ready_fd);
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    while (!stop_requested) {
+        if (poll(&pfd, 1, 100) <= 0) {
+            continue;
+        }
+        len = read(fd, buffer, buffer_size);
+        if (len < 0) {
+            if (errno == EAGAIN || errno == EINTR) {
+                continue;
+            }
+            perror("read");
+            break;
+        }
+
+        for (off = 0; off + (ssize_t)sizeof(frame_len) <= len; off += sizeof(frame_len) + frame_len) {
+            unsigned long long now = now_ns();
+            unsigned long long latency;
+
+            memcpy(&frame_len, buffer + off, sizeof(frame_len));
+            if (frame_len < sizeof(header)) {
+                continue;
+            }
+            memcpy(&header, buffer + off + sizeof(frame_len), sizeof(header));
+            latency = now > header.send_ns ? now - header.send_ns : 0;
+
+            res->received++;
+            res->bytes += frame_len;
+            res->hist[hist_index(latency)]++;
+            if (latency > res->max_ns) {
+                res->max_ns = latency;
+            }
+            /* Sequencias comecam em 1; a lacuna e o que o driver descartou */
+            if (header.publisher < (__u32)opt->publishers) {
+                if (header.seq > last_seq[header.publisher] + 1) {
+                    res->lost += header.seq - last_seq[header.publisher] - 1;
+                }
+                if (header.seq > last_seq[header.publisher]) {
+                    last_seq[header.publisher] = header.seq;
+                }
+            }
+        }
+    }
+
+    close(fd);
+    free(buffer);
+    free(last_seq);
+    return 0;
+}
+
+/*
+ * Publicador: percorre os topicos em rodizio, usando o handle devolvido
+ * pela primeira publicacao em cada um. A sequencia e por topico, ja que
+ * cada inscrito so ve o seu. Com taxa, espera ate o instante
+ * absoluto da proxima mensagem para nao acumular atraso.
+ */
+static int run_publisher(int id, const struct options *opt, struct worker_result *res)
+{
+    struct pubsub_publish_arg arg;
+    struct msg_header *header;
+    struct timespec next;
+    unsigned long long interval_ns = 0;
+    unsigned long long *seqs;
+    __u32 *handles;
+    char name[64];
+    char *payload;
+    int fd, topic = id % opt->topics;
+    int ret;
+
+    payload = calloc(1, opt->payload_size);
+    handles = calloc(opt->topics, sizeof(*handles));
+    seqs = calloc(opt->topics, sizeof(*seqs));
+    if (!payload || !handles || !seqs) {
+        return 1;
+    }
+    header = (struct msg_header *)payload;
+    header->publisher = id;
+
+    fd = open(DEVICE_PATH, O_RDWR);
+    if (fd < 0) {
+        perror("open");
+        return 1;
+    }
+
+    if (opt->rate > 0) {
+        interval_ns = 1000000000ULL / opt->rate;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
+    while (!stop_requested) {
+        memset(&arg, 0, sizeof(arg));
+        if (handles[topic]) {
+            arg.name = handles[topic];
+            arg.name_len = 0;
+        } else {
+            topic_name(name, sizeof(name), topic);
+            arg.name = (__u64)(unsigned long)name;
+            arg.name_len = strlen(name);
+        }
+        arg.payload = (__u64)(unsigned long)payload;
+        arg.payload_len = opt->payload_size;
+
+        header->seq = ++seqs[topic];
+        header->send_ns = now_ns();
+        ret = ioctl(fd, PUBSUB_IOC_PUBLISH, &arg);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                break;
+            }
+            /* Sem aumentar a sequencia ninguem conta a falha como perda */
+            seqs[topic]--;
+            res->publish_errors++;
+        } else {
+            handles[topic] = ret;
+            res->published++;
+            res->bytes += opt->payload_size;
+        }
+        topic = (topic + 1) % opt->topics;
+
+        if (interval_ns) {
+            next.tv_nsec += interval_ns;
+            while (next.tv_nsec >= 1000000000L) {
+                next.tv_nsec -= 1000000000L;
+                next.tv_sec++;
+            }
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+        }
+    }
+
+    close(fd);
+    free(payload);
+    free(handles);
+    free(seqs);
+    return 0;
+}
+
+/* Soma overwritten/dropped dos topicos do benchmark; -1 sem debugfs */
+static int read_driver_stats(unsigned long long *overwritten, unsigned long long *dropped)
+{
+    unsigned long long pub, del, over, drop;
+    char line[512];
+    char name[PUBSUB_TOPIC_NAME_MAX + 1];
+    FILE *stats;
+    int handle;
+
+    *overwritten = 0;
+    *dropped = 0;
+    stats = fopen(STATS_PATH, "r");
+    if (!stats) {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), stats)) {
+        if (sscanf(line, "topic %127s handle %d published %llu delivered %llu overwritten %llu dropped %llu",
+                   name, &handle, &pub, &del, &over, &drop) == 6 &&
+            strncmp(name, TOPIC_PREFIX, strlen(TOPIC_PREFIX)) == 0) {
+            *overwritten += over;
+            *dropped += drop;
+        }
+    }
+    fclose(stats);
+    return 0;
+}
+
+static void stop_workers(const pid_t *pids, int from, int to)
+{
+    int i;
+
+    for (i = from; i < to; i++) {
+        kill(pids[i], SIGUSR1);
+    }
+    for (i = from; i < to; i++) {
+        waitpid(pids[i], NULL, 0);
+    }
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-p publishers] [-s subscribers] [-t topics] [-b payload_bytes]\n"
+            "          [-r msgs_per_sec_per_publisher] [-d seconds] [-P overwrite|drop|block]\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    struct options opt = { 1, 1, 1, 64, 0, 5, -1 };
+    struct worker_result *results, total;
+    unsigned long long over_before, drop_before, over_after, drop_after;
+    unsigned long long start, elapsed;
+    double seconds;
+    pid_t *pids;
+    int workers, ready_pipe[2];
+    int have_stats;
+    int c, i, j;
+    char ready;
+
+    while ((c = getopt(argc, argv, "p:s:t:b:r:d:P:h")) != -1) {
+        switch (c) {
+        case 'p': opt.publishers = atoi(optarg); break;
+        case 's': opt.subscribers = atoi(optarg); break;
+        case 't': opt.topics = atoi(optarg); break;
+        case 'b': opt.payload_size = atoi(optarg); break;
+        case 'r': opt.rate = atol(optarg); break;
+        case 'd': opt.duration = atoi(optarg); break;
+        case 'P':
+            if (strcmp(optarg, "overwrite") == 0) {
+                opt.policy = PUBSUB_POLICY_OVERWRITE;
+            } else if (strcmp(optarg, "drop") == 0) {
+                opt.policy = PUBSUB_POLICY_DROP_NEWEST;
+            } else if (strcmp(optarg, "block") == 0) {
+                opt.policy = PUBSUB_POLICY_BLOCK;
+            } else {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (opt.publishers < 0 || opt.publishers > MAX_PUBLISHERS || opt.subscribers < 0 ||
+        opt.topics < 1 || opt.duration < 1 || opt.rate < 0 ||
+        opt.payload_size < (int)sizeof(struct msg_header)) {
+        fprintf(stderr, "invalid options (payload must be at least %zu bytes)\n", sizeof(struct msg_header));
+        return 1;
+    }
+
+    workers = opt.subscribers + opt.publishers;
+    results = mmap(NULL, (workers ? workers : 1) * sizeof(*results), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    pids = calloc(workers ? workers : 1, sizeof(*pids));
+    if (results == MAP_FAILED || !pids || pipe(ready_pipe) < 0) {
+        perror("setup");
+        return 1;
+    }
+    memset(results, 0, workers * sizeof(*results));
+
+    if (configure_topics(&opt) < 0) {
+        return 1;
+    }
+    have_stats = read_driver_stats(&over_before, &drop_before) == 0;
+
+    /* Herdado pelos filhos antes do fork: nenhum SIGUSR1 chega sem tratador */
+    signal(SIGUSR1, on_stop);
+
+    /* Inscritos primeiro: so se publica depois que todos estao prontos */
+    for (i = 0; i < opt.subscribers; i++) {
+        pids[i] = fork();
+        if (pids[i] == 0) {
+            close(ready_pipe[0]);
+            _exit(run_subscriber(i, &opt, &results[i], ready_pipe[1]));
+        }
+    }
+    close(ready_pipe[1]);
+    for (i = 0; i < opt.subscribers; i++) {
+        if (read(ready_pipe[0], &ready, 1) != 1) {
+            fprintf(stderr, "subscriber failed to start\n");
+            stop_workers(pids, 0, opt.subscribers);
+            return 1;
+        }
+    }
+    close(ready_pipe[0]);
+
+    start = now_ns();
+    for (i = 0; i < opt.publishers; i++) {
+        j = opt.subscribers + i;
+        pids[j] = fork();
+        if (pids[j] == 0) {
+            _exit(run_publisher(i, &opt, &results[j]));
+        }
+    }
+
+    sleep(opt.duration);
+    stop_workers(pids, opt.subscribers, workers);
+    elapsed = now_ns() - start;
+    /* Deixa os inscritos drenarem o que ja esta nas caixas */
+    usleep(200000);
+    stop_workers(pids, 0, opt.subscribers);
+
+    if (have_stats) {
+        have_stats = read_driver_stats(&over_after, &drop_after) == 0;
+    }
+
+    memset(&total, 0, sizeof(total));
+    for (i = 0; i < workers; i++) {
+        total.published += results[i].published;
+        total.publish_errors += results[i].publish_errors;
+        total.received += results[i].received;
+        total.lost += results[i].lost;
+        if (i < opt.subscribers) {
+            total.bytes += results[i].bytes;
+        }
+        if (results[i].max_ns > total.max_ns) {
+            total.max_ns = results[i].max_ns;
+        }
+        for (j = 0; j < HIST_BUCKETS; j++) {
+            total.hist[j] += results[i].hist[j];
+        }
+    }
+    seconds = elapsed / 1e9;
+
+    printf("{\"publishers\":%d,\"subscribers\":%d,\"topics\":%d,\"payload_size\":%d,"
+           "\"rate\":%ld,\"duration_s\":%.3f,",
+           opt.publishers, opt.subscribers, opt.topics, opt.payload_size, opt.rate, seconds);
+    printf("\"published\":%llu,\"publish_errors\":%llu,\"received\":%llu,\"lost\":%llu,",
+           total.published, total.publish_errors, total.received, total.lost);
+    printf("\"publish_msgs_per_s\":%.1f,\"receive_msgs_per_s\":%.1f,\"receive_bytes_per_s\":%.1f,",
+           total.published / seconds, total.received / seconds, total.bytes / seconds);
+    printf("\"latency_ns\":{\"p50\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu},",
+           hist_percentile(total.hist, total.received, 50.0),
+           hist_percentile(total.hist, total.received, 99.0),
+           hist_percentile(total.hist, total.received, 99.9),
+           total.max_ns);
+    if (have_stats) {
+        printf("\"driver\":{\"overwritten\":%llu,\"dropped\":%llu}}\n",
+               over_after - over_before, drop_after - drop_before);
+    } else {
+        printf("\"driver\":null}\n");
+    }
+
+    munmap(results, (workers ? workers : 1) * sizeof(*results));
+    free(pids);
+    return 0;
+}
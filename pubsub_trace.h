@@ -0,0 +1,136 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM pubsub
+
+#if !defined(_PUBSUB_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _PUBSUB_TRACE_H
+
+/*
+ * Tracepoints do broker, em /sys/kernel/debug/tracing/events/pubsub/.
+ * Desligados custam so um branch; substituem os printk por operacao.
+ * Os pontos sao definidos em main_driver.c (CREATE_TRACE_POINTS).
+ */
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(pubsub_register,
+
+    TP_PROTO(const char *topic, int pid, char list_type),
+
+    TP_ARGS(topic, pid, list_type),
+
+    TP_STRUCT__entry(
+        __string(topic, topic)
+        __field(int, pid)
+        __field(char, list_type)
+    ),
+
+    TP_fast_assign(
+        __assign_str(topic, topic);
+        __entry->pid = pid;
+        __entry->list_type = list_type;
+    ),
+
+    TP_printk("topic=%s pid=%d type=%c", __get_str(topic), __entry->pid, __entry->list_type)
+);
+
+TRACE_EVENT(pubsub_unsubscribe,
+
+    TP_PROTO(const char *topic, int pid),
+
+    TP_ARGS(topic, pid),
+
+    TP_STRUCT__entry(
+        __string(topic, topic)
+        __field(int, pid)
+    ),
+
+    TP_fast_assign(
+        __assign_str(topic, topic);
+        __entry->pid = pid;
+    ),
+
+    TP_printk("topic=%s pid=%d", __get_str(topic), __entry->pid)
+);
+
+TRACE_EVENT(pubsub_publish,
+
+    TP_PROTO(const char *topic, unsigned int count, size_t bytes),
+
+    TP_ARGS(topic, count, bytes),
+
+    TP_STRUCT__entry(
+        __string(topic, topic)
+        __field(unsigned int, count)
+        __field(size_t, bytes)
+    ),
+
+    TP_fast_assign(
+        __assign_str(topic, topic);
+        __entry->count = count;
+        __entry->bytes = bytes;
+    ),
+
+    TP_printk("topic=%s count=%u bytes=%zu", __get_str(topic), __entry->count, __entry->bytes)
+);
+
+TRACE_EVENT(pubsub_deliver,
+
+    TP_PROTO(const char *topic, int pid, unsigned int count, int overwritten, int dropped, unsigned int depth),
+
+    TP_ARGS(topic, pid, count, overwritten, dropped, depth),
+
+    TP_STRUCT__entry(
+        __string(topic, topic)
+        __field(int, pid)
+        __field(unsigned int, count)
+        __field(int, overwritten)
+        __field(int, dropped)
+        __field(unsigned int, depth)
+    ),
+
+    TP_fast_assign(
+        __assign_str(topic, topic);
+        __entry->pid = pid;
+        __entry->count = count;
+        __entry->overwritten = overwritten;
+        __entry->dropped = dropped;
+        __entry->depth = depth;
+    ),
+
+    TP_printk("topic=%s pid=%d count=%u overwritten=%d dropped=%d depth=%u",
+              __get_str(topic), __entry->pid, __entry->count,
+              __entry->overwritten, __entry->dropped, __entry->depth)
+);
+
+TRACE_EVENT(pubsub_read,
+
+    TP_PROTO(const char *topic, int pid, int mode, ssize_t ret),
+
+    TP_ARGS(topic, pid, mode, ret),
+
+    TP_STRUCT__entry(
+        __string(topic, topic)
+        __field(int, pid)
+        __field(int, mode)
+        __field(ssize_t, ret)
+    ),
+
+    TP_fast_assign(
+        __assign_str(topic, topic);
+        __entry->pid = pid;
+        __entry->mode = mode;
+        __entry->ret = ret;
+    ),
+
+    TP_printk("topic=%s pid=%d mode=%s ret=%zd", __get_str(topic), __entry->pid,
+              __entry->mode ? "batch" : "single", __entry->ret)
+);
+
+#endif /* _PUBSUB_TRACE_H */
+
+/* Fora do include guard: define_trace.h le este arquivo de novo */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE pubsub_trace
+#include <trace/define_trace.h>
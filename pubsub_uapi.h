@@ -0,0 +1,195 @@
+#ifndef PUBSUB_UAPI_H
+#define PUBSUB_UAPI_H
+
+/*
+ * Estruturas compartilhadas entre o driver e os programas em espaco de
+ * usuario. So usa tipos de <linux/types.h> para servir aos dois lados.
+ */
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/*
+ * Anel de consumo via mmap().
+ *
+ * Depois de /subscribe e /fetch, um mmap() no fd mapeia a mailbox do
+ * processo. A primeira pagina tem o cabecalho abaixo; os slots comecam em
+ * data_offset, cada um com slot_size bytes.
+ *
+ * head e escrito pelo kernel e tail pelo consumidor; ambos sao contadores
+ * livres, o slot e (contador % slot_count). O consumidor le o slot em
+ * tail enquanto tail != head e so entao avanca tail. Com o anel cheio a
+ * mensagem nova e descartada e 'dropped' e incrementado.
+ *
+ * slot_size cobre ate min(max_msg_size, 64 KiB) de dados; mensagens
+ * maiores tambem sao descartadas e contadas em 'dropped'. O anel inteiro
+ * conta em max_queued_bytes: se nao couber, o mmap() falha com ENOMEM.
+ */
+struct pubsub_mmap_ring {
+    __u32 head;
+    __u32 tail;
+    __u32 slot_count;
+    __u32 slot_size;
+    __u32 data_offset;
+    __u32 reserved;
+    __u64 dropped;
+};
+
+struct pubsub_mmap_slot {
+    __u32 len;
+    __u32 reserved;
+    char data[];
+};
+
+/*
+ * Interface binaria por ioctl(), alternativa aos comandos de texto do
+ * write(). Nomes e payloads vao por ponteiro + tamanho explicito, entao o
+ * payload pode ter aspas, '\0' ou qualquer byte.
+ *
+ * Handles: PUBSUB_IOC_SUBSCRIBE e PUBSUB_IOC_PUBLISH devolvem (como valor
+ * de retorno do ioctl, > 0) um handle numerico do topico. Nas chamadas
+ * seguintes, name_len == 0 faz o campo 'name' ser lido como esse handle em
+ * vez de um ponteiro, e o kernel nao precisa copiar nem procurar o nome.
+ * O handle vale para todos os processos enquanto o modulo estiver
+ * carregado.
+ */
+
+/*
+ * Topicos hierarquicos: niveis separados por '/'. Inscricoes aceitam os
+ * curingas do MQTT ocupando um nivel inteiro: '+' casa exatamente um nivel
+ * e '#', so no fim, casa o resto do nome (inclusive nenhum nivel, entao
+ * "a/#" recebe "a"). Topicos iniciados por '$' nao casam curingas no
+ * primeiro nivel. Nao se publica em um nome com curingas (EINVAL).
+ */
+#define PUBSUB_IOC_MAGIC 'P'
+#define PUBSUB_TOPIC_NAME_MAX 127
+
+struct pubsub_topic_arg {
+    __u64 name;         /* ponteiro para o nome, sem '\0' obrigatorio, ou handle */
+    __u32 name_len;     /* 0: 'name' e um handle */
+    __u32 reserved;
+};
+
+struct pubsub_publish_arg {
+    __u64 name;
+    __u32 name_len;
+    __u32 payload_len;
+    __u64 payload;      /* ponteiro para os bytes da mensagem */
+};
+
+/*
+ * Lote de publicacoes em uma unica chamada. Entradas consecutivas no mesmo
+ * topico sao entregues juntas. 'published' volta com quantas entradas
+ * foram entregues (enfileiradas, em topico async), sempre um prefixo do
+ * vetor; se houver erro, a entrada 'published' e a primeira nao entregue.
+ * writev() segue a mesma regra: conta so os bytes dos segmentos
+ * concluidos e o erro fica para a proxima chamada.
+ */
+struct pubsub_publish_batch_arg {
+    __u64 entries;      /* ponteiro para um vetor de struct pubsub_publish_arg */
+    __u32 count;
+    __u32 published;
+};
+
+/*
+ * Configuracao por topico (PUBSUB_IOC_SET_CONFIG ou, em texto,
+ * "/config <topico> policy overwrite|drop|block" e
+ * "/config <topico> block_timeout <ms>"). So os campos marcados em 'set'
+ * sao aplicados; o topico e criado se ainda nao existir.
+ *
+ * Politicas para mailbox cheia:
+ *  - OVERWRITE: descarta a mensagem mais antiga (padrao).
+ *  - DROP_NEWEST: descarta a mensagem nova.
+ *  - BLOCK: o publicador espera ate block_timeout_ms por espaco em todas
+ *    as mailboxes; se o tempo acabar a publicacao falha com EAGAIN e nada
+ *    e entregue, nem ao topico nem aos filtros que casam com o nome. Vale
+ *    para todos os destinos BLOCK de uma vez (o topico e esses filtros),
+ *    com o menor block_timeout_ms entre eles, e inclui a espera por outros
+ *    publicadores. Um lote maior que a mailbox (max_msg_n) sai em pedacos
+ *    desse tamanho; se o tempo acabar depois do primeiro, 'published'
+ *    conta so os pedacos entregues. Inscritos por mmap nao bloqueiam: ali
+ *    vale o descarte do proprio anel.
+ *
+ * Com 'async' (PUBSUB_CONFIG_ASYNC, "/config <topico> async on|off") a
+ * publicacao so enfileira a mensagem e retorna; a entrega as mailboxes
+ * acontece numa workqueue, repartida entre CPUs quando o topico tem muitos
+ * inscritos. A ordem por topico e mantida. PUBSUB_IOC_FLUSH (ou "/flush
+ * <topico>") espera a entrega do que ja estava na fila na chamada; o que
+ * a entrega nao conseguir (filtros BLOCK cheios: aqui nao se espera)
+ * conta em 'dropped'. Nao combina com BLOCK: nao ha publicador para
+ * esperar nem para receber o EAGAIN.
+ *
+ * Com 'log_entries' (PUBSUB_CONFIG_LOG, "/config <topico> log <n>") o
+ * topico guarda as ultimas n mensagens (arredondado para potencia de 2)
+ * num log unico; cada inscrito so tem uma posicao, a sequencia absoluta
+ * da proxima mensagem, e a politica nao se aplica. Um inscrito novo
+ * comeca no fim do log. lseek() no fd do /fetch move a posicao:
+ * SEEK_SET para uma sequencia, SEEK_CUR relativo, SEEK_END relativo ao
+ * fim (0 pula o atraso, -k rele as ultimas k). Quem ficou para tras nao
+ * perde mensagens em silencio: read() falha com EOVERFLOW ate o lseek, e
+ * PUBSUB_IOC_LOG_STATUS diz quanto se perdeu. Com 0 o modo e desligado.
+ * So muda com o topico sem inscritos (EBUSY); inscritos de log nao usam
+ * mmap. As mensagens guardadas contam em max_queued_bytes.
+ *
+ * Com 'retain' (PUBSUB_CONFIG_RETAIN, "/config <topico> retain on") o
+ * topico guarda a ultima mensagem publicada, uma copia so, e a coloca na
+ * mailbox de cada inscrito novo; quem se inscreve num topico de estado
+ * nao precisa esperar a proxima publicacao. Num filtro e a ultima
+ * mensagem que casou. Desligar descarta a mensagem guardada.
+ */
+#define PUBSUB_POLICY_OVERWRITE   0
+#define PUBSUB_POLICY_DROP_NEWEST 1
+#define PUBSUB_POLICY_BLOCK       2
+
+#define PUBSUB_CONFIG_POLICY        (1U << 0)
+#define PUBSUB_CONFIG_BLOCK_TIMEOUT (1U << 1)
+#define PUBSUB_CONFIG_ASYNC         (1U << 2)
+#define PUBSUB_CONFIG_LOG           (1U << 3)
+#define PUBSUB_CONFIG_RETAIN        (1U << 4)
+#define PUBSUB_CONFIG_ALL (PUBSUB_CONFIG_POLICY | PUBSUB_CONFIG_BLOCK_TIMEOUT | PUBSUB_CONFIG_ASYNC | \
+                           PUBSUB_CONFIG_LOG | PUBSUB_CONFIG_RETAIN)
+#define PUBSUB_LOG_MAX_ENTRIES      (1U << 20)
+
+struct pubsub_topic_config {
+    __u64 name;         /* nome ou handle, como em pubsub_topic_arg */
+    __u32 name_len;
+    __u32 set;          /* PUBSUB_CONFIG_* a aplicar */
+    __u32 policy;
+    __u32 block_timeout_ms;
+    __u32 async;        /* 0 ou 1 */
+    __u32 log_entries;  /* 0 desliga o modo log */
+    __u32 retain;       /* 0 ou 1 */
+    __u32 reserved[3];
+};
+
+/* Posicao de um inscrito em modo log, em sequencias absolutas */
+struct pubsub_log_status {
+    __u64 position;     /* proxima mensagem a ler */
+    __u64 first;        /* mais antiga ainda no log */
+    __u64 head;         /* proxima a ser publicada; head - position = atraso */
+    __u64 lost;         /* first - position se ficou para tras, senao 0 */
+};
+
+/*
+ * Modos de leitura por fd (PUBSUB_IOC_SET_READ_MODE):
+ *  - SINGLE: uma mensagem por read(), truncada no tamanho do buffer.
+ *  - BATCH: o buffer recebe quantas mensagens inteiras couberem, cada uma
+ *    como um __u32 com o tamanho seguido dos bytes, sem alinhamento. Se a
+ *    proxima mensagem nao couber, ela continua na fila e o read() falha com
+ *    EMSGSIZE; PUBSUB_IOC_NEXT_SIZE devolve o tamanho de buffer necessario.
+ */
+#define PUBSUB_READ_SINGLE 0
+#define PUBSUB_READ_BATCH  1
+
+#define PUBSUB_IOC_SUBSCRIBE   _IOW(PUBSUB_IOC_MAGIC, 1, struct pubsub_topic_arg)
+#define PUBSUB_IOC_UNSUBSCRIBE _IOW(PUBSUB_IOC_MAGIC, 2, struct pubsub_topic_arg)
+#define PUBSUB_IOC_FETCH       _IOW(PUBSUB_IOC_MAGIC, 3, struct pubsub_topic_arg)
+#define PUBSUB_IOC_PUBLISH     _IOW(PUBSUB_IOC_MAGIC, 4, struct pubsub_publish_arg)
+#define PUBSUB_IOC_PUBLISH_BATCH _IOWR(PUBSUB_IOC_MAGIC, 5, struct pubsub_publish_batch_arg)
+#define PUBSUB_IOC_SET_READ_MODE _IOW(PUBSUB_IOC_MAGIC, 6, __u32)
+#define PUBSUB_IOC_NEXT_SIZE     _IOR(PUBSUB_IOC_MAGIC, 7, __u32)
+#define PUBSUB_IOC_SET_CONFIG    _IOW(PUBSUB_IOC_MAGIC, 8, struct pubsub_topic_config)
+#define PUBSUB_IOC_FLUSH         _IOW(PUBSUB_IOC_MAGIC, 9, struct pubsub_topic_arg)
+#define PUBSUB_IOC_LOG_STATUS    _IOR(PUBSUB_IOC_MAGIC, 10, struct pubsub_log_status)
+
+#endif
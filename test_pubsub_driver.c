@@ -4,31 +4,360 @@
 #include <fcntl.h>
 #include <string.h>
 #include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+
+#include "pubsub_uapi.h"
 
 #define BUFFER_LENGTH 256
-#define MAX_MSG_SIZE 250
+#define DEVICE_PATH "/dev/pubsub_driver"
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void on_stop(int sig)
+{
+    (void)sig;
+    stop_requested = 1;
+}
+
+/* Conta os quadros (__u32 tamanho + bytes) de um read() em modo lote */
+static long count_frames(const char *buffer, ssize_t len)
+{
+    __u32 frame_len;
+    long frames = 0;
+    ssize_t off = 0;
+
+    while (off + (ssize_t)sizeof(frame_len) <= len) {
+        memcpy(&frame_len, buffer + off, sizeof(frame_len));
+        off += sizeof(frame_len) + frame_len;
+        frames++;
+    }
+    return frames;
+}
+
+/*
+ * Subscriber do modo stress: inscreve-se em um topico, avisa o pai pelo
+ * pipe e espera mensagens com poll() ate receber SIGUSR1. Le em modo lote,
+ * drenando varias mensagens por read().
+ */
+static int stress_subscriber(int id, int topics, int ready_fd)
+{
+    char command[BUFFER_LENGTH];
+    char message[16 * BUFFER_LENGTH];
+    __u32 read_mode = PUBSUB_READ_BATCH;
+    long received = 0;
+    ssize_t bytes_read;
+    struct pollfd pfd;
+    int fd, ret;
+
+    signal(SIGUSR1, on_stop);
+
+    fd = open(DEVICE_PATH, O_RDWR);
+    if (fd < 0) {
+        perror("stress subscriber: open");
+        return 1;
+    }
+
+    snprintf(command, sizeof(command), "/subscribe stress%d", id % topics);
+    if (write(fd, command, strlen(command)) < 0) {
+        perror("stress subscriber: /subscribe");
+        return 1;
+    }
+    snprintf(command, sizeof(command), "/fetch stress%d", id % topics);
+    if (write(fd, command, strlen(command)) < 0) {
+        perror("stress subscriber: /fetch");
+        return 1;
+    }
+    if (ioctl(fd, PUBSUB_IOC_SET_READ_MODE, &read_mode) < 0) {
+        perror("stress subscriber: PUBSUB_IOC_SET_READ_MODE");
+        return 1;
+    }
+
+    if (write(ready_fd, "r", 1) != 1) {
+        return 1;
+    }
+    close(ready_fd);
+
+    while (!stop_requested) {
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        ret = poll(&pfd, 1, 100);
+        if (ret < 0 && errno != EINTR) {
+            perror("stress subscriber: poll");
+            break;
+        }
+        if (ret <= 0 || !(pfd.revents & POLLIN)) {
+            continue;
+        }
+
+        bytes_read = read(fd, message, sizeof(message));
+        if (bytes_read > 0) {
+            received += count_frames(message, bytes_read);
+        } else if (bytes_read < 0 && errno != EINTR) {
+            perror("stress subscriber: read");
+            break;
+        }
+    }
+
+    /* Publicadores terminaram: drena o que sobrou sem bloquear */
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    while ((bytes_read = read(fd, message, sizeof(message))) > 0) {
+        received += count_frames(message, bytes_read);
+    }
+
+    printf("[stress] subscriber %d (pid %d) topic stress%d received %ld\n",
+           id, (int)getpid(), id % topics, received);
+    close(fd);
+    return 0;
+}
 
-int main()
+static int stress_publisher(int id, int topics, int messages)
+{
+    char command[BUFFER_LENGTH];
+    int fd, i, failures = 0;
+
+    fd = open(DEVICE_PATH, O_RDWR);
+    if (fd < 0) {
+        perror("stress publisher: open");
+        return 1;
+    }
+
+    for (i = 0; i < messages; i++) {
+        snprintf(command, sizeof(command), "/publish stress%d \"p%d m%d\"", i % topics, id, i);
+        if (write(fd, command, strlen(command)) < 0) {
+            failures++;
+        }
+    }
+
+    printf("[stress] publisher %d (pid %d) sent %d, failed %d\n", id, (int)getpid(), messages, failures);
+    close(fd);
+    return failures ? 1 : 0;
+}
+
+/*
+ * Uso: test_pubsub_driver --stress [publishers] [subscribers] [topics] [messages]
+ */
+static int run_stress(int argc, char *argv[])
+{
+    int publishers = argc > 0 ? atoi(argv[0]) : 8;
+    int subscribers = argc > 1 ? atoi(argv[1]) : 8;
+    int topics = argc > 2 ? atoi(argv[2]) : 4;
+    int messages = argc > 3 ? atoi(argv[3]) : 1000;
+    pid_t *sub_pids;
+    int ready_pipe[2];
+    int i, status, failed = 0;
+    char ready;
+
+    if (publishers <= 0 || subscribers < 0 || topics <= 0 || messages <= 0) {
+        fprintf(stderr, "Usage: test_pubsub_driver --stress [publishers] [subscribers] [topics] [messages]\n");
+        return EINVAL;
+    }
+
+    printf("Stress: %d publishers, %d subscribers, %d topics, %d messages per publisher\n",
+           publishers, subscribers, topics, messages);
+
+    sub_pids = calloc(subscribers ? subscribers : 1, sizeof(*sub_pids));
+    if (!sub_pids || pipe(ready_pipe) < 0) {
+        perror("stress setup");
+        return errno;
+    }
+
+    for (i = 0; i < subscribers; i++) {
+        sub_pids[i] = fork();
+        if (sub_pids[i] == 0) {
+            close(ready_pipe[0]);
+            exit(stress_subscriber(i, topics, ready_pipe[1]));
+        }
+    }
+    close(ready_pipe[1]);
+
+    /* Espera todas as inscricoes antes de comecar a publicar */
+    for (i = 0; i < subscribers; i++) {
+        if (read(ready_pipe[0], &ready, 1) != 1) {
+            fprintf(stderr, "A stress subscriber failed to start\n");
+            break;
+        }
+    }
+    close(ready_pipe[0]);
+
+    for (i = 0; i < publishers; i++) {
+        if (fork() == 0) {
+            exit(stress_publisher(i, topics, messages));
+        }
+    }
+
+    for (i = 0; i < publishers; i++) {
+        if (wait(&status) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            failed++;
+        }
+    }
+
+    for (i = 0; i < subscribers; i++) {
+        kill(sub_pids[i], SIGUSR1);
+    }
+    for (i = 0; i < subscribers; i++) {
+        if (waitpid(sub_pids[i], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            failed++;
+        }
+    }
+
+    free(sub_pids);
+    printf("Stress finished: %d process(es) failed\n", failed);
+    return failed ? 1 : 0;
+}
+
+/*
+ * Consumidor via mmap: mapeia a mailbox e le os slots direto da memoria
+ * compartilhada, usando poll() so quando o anel esta vazio.
+ * Uso: test_pubsub_driver --mmap <topic>
+ */
+static int run_mmap_reader(const char *topic)
+{
+    char command[BUFFER_LENGTH];
+    struct pubsub_mmap_ring *ring;
+    struct pubsub_mmap_slot *slot;
+    struct pollfd pfd;
+    size_t map_size;
+    __u32 head, tail;
+    long page_size = sysconf(_SC_PAGESIZE);
+    int fd;
+
+    fd = open(DEVICE_PATH, O_RDWR);
+    if (fd < 0) {
+        perror("Failed to open the device " DEVICE_PATH);
+        return errno;
+    }
+
+    snprintf(command, sizeof(command), "/subscribe %s", topic);
+    if (write(fd, command, strlen(command)) < 0) {
+        perror("Failed to subscribe");
+        return errno;
+    }
+    snprintf(command, sizeof(command), "/fetch %s", topic);
+    if (write(fd, command, strlen(command)) < 0) {
+        perror("Failed to fetch");
+        return errno;
+    }
+
+    /* Primeiro so o cabecalho, para descobrir o tamanho do anel */
+    ring = mmap(NULL, page_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ring == MAP_FAILED) {
+        perror("Failed to map the mailbox header");
+        return errno;
+    }
+    map_size = ring->data_offset + (size_t)ring->slot_count * ring->slot_size;
+    map_size = (map_size + page_size - 1) / page_size * page_size;
+    munmap(ring, page_size);
+
+    ring = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ring == MAP_FAILED) {
+        perror("Failed to map the mailbox");
+        return errno;
+    }
+
+    printf("Mapped mailbox of topic '%s': %u slots of %u bytes\n", topic, ring->slot_count, ring->slot_size);
+
+    tail = ring->tail;
+    while (1) {
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            pfd.fd = fd;
+            pfd.events = POLLIN;
+            if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+                perror("poll");
+                break;
+            }
+            if (pfd.revents & POLLHUP) {
+                break;
+            }
+            continue;
+        }
+
+        while (tail != head) {
+            slot = (struct pubsub_mmap_slot *)((char *)ring + ring->data_offset +
+                   (size_t)(tail % ring->slot_count) * ring->slot_size);
+            printf("  [MSG]: %.*s\n", (int)slot->len, slot->data);
+            tail++;
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+        if (ring->dropped) {
+            printf("  [dropped so far: %llu]\n", (unsigned long long)ring->dropped);
+        }
+    }
+
+    munmap(ring, map_size);
+    close(fd);
+    return 0;
+}
+
+/*
+ * Drena a mailbox sem bloquear, ajustando o buffer ao tamanho de cada
+ * mensagem (PUBSUB_IOC_NEXT_SIZE), entao mensagens grandes nao truncam.
+ */
+static ssize_t drain_messages(int fd, char **buffer, size_t *buffer_size)
+{
+    __u32 next_size;
+    ssize_t bytes_read;
+    char *grown;
+
+    for (;;) {
+        if (ioctl(fd, PUBSUB_IOC_NEXT_SIZE, &next_size) == 0 && next_size + 1 > *buffer_size) {
+            grown = realloc(*buffer, next_size + 1);
+            if (!grown) {
+                errno = ENOMEM;
+                return -1;
+            }
+            *buffer = grown;
+            *buffer_size = next_size + 1;
+        }
+
+        bytes_read = read(fd, *buffer, *buffer_size - 1);
+        if (bytes_read <= 0) {
+            return bytes_read;
+        }
+        (*buffer)[bytes_read] = '\0';
+        if (bytes_read > 200) {
+            printf("  [MSG]: %.200s... (%zd bytes)\n", *buffer, bytes_read);
+        } else {
+            printf("  [MSG]: %s\n", *buffer);
+        }
+    }
+}
+
+int main(int argc, char *argv[])
 {
     int ret, fd;
-    char commandToSend[BUFFER_LENGTH];
-    char messageBuffer[MAX_MSG_SIZE];
+    char *commandToSend = NULL;
+    size_t commandSize = 0;
+    char *messageBuffer = NULL;
+    size_t messageSize = 0;
     ssize_t bytes_read;
     
+    if (argc > 1 && strcmp(argv[1], "--stress") == 0) {
+        return run_stress(argc - 2, argv + 2);
+    }
+    if (argc > 2 && strcmp(argv[1], "--mmap") == 0) {
+        return run_mmap_reader(argv[2]);
+    }
+
     printf("Starting PubSub user-space client...\n");
     
-    fd = open("/dev/pubsub_driver", O_RDWR);
+    fd = open(DEVICE_PATH, O_RDWR);
     if (fd < 0) {
         perror("Failed to open the device /dev/pubsub_driver");
         return errno;
     }
     
     while (1) {
-        printf("\nEnter command (/subscribe, /publish, /fetch, /unsubscribe) or press ENTER to exit:\n> ");
-        
-        memset(commandToSend, 0, BUFFER_LENGTH);
+        printf("\nEnter command (/subscribe, /publish, /fetch, /unsubscribe, /config, /flush) or press ENTER to exit:\n> ");
         
-        if (fgets(commandToSend, BUFFER_LENGTH - 1, stdin) == NULL) {
+        /* getline: comandos de /publish podem ter mensagens grandes */
+        if (getline(&commandToSend, &commandSize, stdin) < 0) {
             break;
         }
         
@@ -46,14 +375,15 @@ int main()
             }
 
             printf("--- Fetching messages ---\n");
-            
-            while ((bytes_read = read(fd, messageBuffer, sizeof(messageBuffer) - 1)) > 0) {
-                messageBuffer[bytes_read] = '\0';
-                printf("  [MSG]: %s\n", messageBuffer);
-            }
 
-            if (bytes_read == 0) {
+            /* read() bloqueia com a mailbox vazia; aqui so drenamos o que ja chegou */
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+            bytes_read = drain_messages(fd, &messageBuffer, &messageSize);
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+
+            if (bytes_read == 0 || errno == EAGAIN) {
                 printf("--- End of messages ---\n");
+            } else {
                 perror("An error occurred while reading messages");
             }
             
@@ -65,6 +395,8 @@ int main()
         }
     }
 
+    free(commandToSend);
+    free(messageBuffer);
     close(fd);
     printf("\nExiting PubSub client.\n");
     